@@ -0,0 +1,340 @@
+/*
+ * Measures VM exit round trips. Each benchmark kernel under guest/ makes
+ * one kind of exit in a loop and times every iteration with RDTSC from
+ * inside the guest, so a sample is the full cost of the exit as the
+ * guest sees it. Next to the distribution of the samples, the cycles the
+ * module counted in the host for the exit reason are reported, see
+ * struct peach_exit_stats.
+ *
+ * usage: exits [iterations], from the top of the tree
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USERSPACE 1
+#include "peach.h"
+#include "loader.h"
+
+/* see guest/bench.h */
+#define BENCH_SAMPLES 0x8000
+#define BENCH_MAX_SAMPLES 0x2000
+
+/* the kernel, its stack-free loop and the samples */
+#define GUEST_MEMORY_SIZE 0x10000
+
+/* where the EPT fault kernel stores, up to the end of real-mode memory */
+#define FRESH_MEMORY_BASE 0x10000
+#define FRESH_MEMORY_SIZE 0xF0000
+
+/* basic exit reasons, see module/vmx.h */
+#define EXIT_REASON_CPUID 10
+#define EXIT_REASON_VMCALL 18
+#define EXIT_REASON_IO_INSTRUCTION 30
+#define EXIT_REASON_EPT_VIOLATION 48
+
+static const struct bench {
+	const char *name;
+	const char *image;
+	int exit_reason;
+	/* stores to memory not touched yet, one per fault */
+	int fresh_memory;
+} benches[] = {
+	{ "cpuid", "guest/bench_cpuid.bin", EXIT_REASON_CPUID, 0 },
+	{ "vmcall", "guest/bench_vmcall.bin", EXIT_REASON_VMCALL, 0 },
+	{ "pio", "guest/bench_pio.bin", EXIT_REASON_IO_INSTRUCTION, 0 },
+	{ "mmio", "guest/bench_mmio.bin", EXIT_REASON_EPT_VIOLATION, 0 },
+	{ "ept fault", "guest/bench_ept.bin", EXIT_REASON_EPT_VIOLATION, 1 },
+};
+
+static int peach_fd;
+
+static int compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The pages one EPT fault maps, so that the stores of the EPT fault
+ * kernel each land in a window of their own.
+ */
+static unsigned int prefault_pages(void)
+{
+	unsigned int pages = 16;
+
+	FILE *f;
+
+	f = fopen("/sys/module/peach/parameters/prefault_pages", "r");
+	if (f) {
+		if (fscanf(f, "%u", &pages) != 1 || !pages) {
+			pages = 1;
+		}
+
+		fclose(f);
+	}
+
+	return pages;
+}
+
+/*
+ * Runs the kernel of b for n iterations in a VM of its own, appends the
+ * samples to samples and adds the module's counts for the exit reason
+ * to *exits and *cycles. stride is passed in CX. Returns 0 on success.
+ */
+static int run(const struct bench *b, int n, uint16_t stride,
+		uint32_t *samples, uint64_t *exits, uint64_t *cycles)
+{
+	int ret = -1;
+	int vm_fd;
+	int vcpu_fd;
+
+	void *guest_memory;
+	void *fresh_memory = MAP_FAILED;
+
+	struct guest_memory mem;
+	struct peach_memory_region region;
+	struct peach_regs regs;
+	struct peach_run run;
+	struct peach_vcpu_stats *stats;
+
+	uint64_t entry;
+
+	stats = malloc(sizeof(*stats));
+	if (!stats) {
+		printf("failed to allocate stats\n");
+
+		goto err0;
+	}
+
+	guest_memory = mmap(NULL, GUEST_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (guest_memory == MAP_FAILED) {
+		printf("failed to allocate guest memory\n");
+
+		goto err1;
+	}
+
+	mem.host = guest_memory;
+	mem.guest_phys_addr = 0;
+	mem.size = GUEST_MEMORY_SIZE;
+	if (load_image(b->image, &mem, 0, &entry) < 0) {
+		goto err2;
+	}
+
+	if ((vm_fd = ioctl(peach_fd, PEACH_CREATE_VM)) < 0) {
+		printf("failed to exec ioctl PEACH_CREATE_VM\n");
+
+		goto err2;
+	}
+
+	region.slot = 0;
+	region.flags = 0;
+	region.guest_phys_addr = 0;
+	region.memory_size = GUEST_MEMORY_SIZE;
+	region.userspace_addr = (uint64_t) guest_memory;
+	if (ioctl(vm_fd, PEACH_SET_MEMORY_REGION, &region) < 0) {
+		printf("failed to exec ioctl PEACH_SET_MEMORY_REGION\n");
+
+		goto err3;
+	}
+
+	if (b->fresh_memory) {
+		fresh_memory = mmap(NULL, FRESH_MEMORY_SIZE,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fresh_memory == MAP_FAILED) {
+			printf("failed to allocate guest memory\n");
+
+			goto err3;
+		}
+
+		region.slot = 1;
+		region.guest_phys_addr = FRESH_MEMORY_BASE;
+		region.memory_size = FRESH_MEMORY_SIZE;
+		region.userspace_addr = (uint64_t) fresh_memory;
+		if (ioctl(vm_fd, PEACH_SET_MEMORY_REGION, &region) < 0) {
+			printf("failed to exec ioctl PEACH_SET_MEMORY_REGION\n");
+
+			goto err3;
+		}
+	}
+
+	if ((vcpu_fd = ioctl(vm_fd, PEACH_CREATE_VCPU, 0)) < 0) {
+		printf("failed to exec ioctl PEACH_CREATE_VCPU\n");
+
+		goto err3;
+	}
+
+	if (ioctl(vcpu_fd, PEACH_GET_REGS, &regs) < 0) {
+		printf("failed to exec ioctl PEACH_GET_REGS\n");
+
+		goto err4;
+	}
+
+	regs.rip = entry;
+	regs.rsi = n;
+	regs.rcx = stride;
+	if (ioctl(vcpu_fd, PEACH_SET_REGS, &regs) < 0) {
+		printf("failed to exec ioctl PEACH_SET_REGS\n");
+
+		goto err4;
+	}
+
+	/* port I/O and MMIO come back here, with nothing to do */
+	memset(&run, 0, sizeof(run));
+	do {
+		if (ioctl(vcpu_fd, PEACH_RUN, &run) < 0) {
+			printf("failed to exec ioctl PEACH_RUN\n");
+
+			goto err4;
+		}
+	} while (run.exit_reason == PEACH_EXIT_IO ||
+			run.exit_reason == PEACH_EXIT_MMIO ||
+			run.exit_reason == PEACH_EXIT_INTR);
+
+	if (run.exit_reason != PEACH_EXIT_SHUTDOWN) {
+		printf("%s: unexpected exit %u\n", b->name, run.exit_reason);
+
+		goto err4;
+	}
+
+	if (ioctl(vcpu_fd, PEACH_GET_STATS, stats) < 0) {
+		printf("failed to exec ioctl PEACH_GET_STATS\n");
+
+		goto err4;
+	}
+
+	memcpy(samples, (char *) guest_memory + BENCH_SAMPLES,
+		n * sizeof(*samples));
+
+	*exits += stats->exits[b->exit_reason].count;
+	*cycles += stats->exits[b->exit_reason].cycles;
+
+	ret = 0;
+
+err4:
+	close(vcpu_fd);
+
+err3:
+	close(vm_fd);
+
+	if (fresh_memory != MAP_FAILED) {
+		munmap(fresh_memory, FRESH_MEMORY_SIZE);
+	}
+
+err2:
+	munmap(guest_memory, GUEST_MEMORY_SIZE);
+
+err1:
+	free(stats);
+
+err0:
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	int n;
+	int done;
+	int per_vm;
+	int iterations = 1000;
+
+	unsigned int window;
+
+	uint16_t stride;
+
+	uint32_t *samples;
+
+	uint64_t exits;
+	uint64_t cycles;
+
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+	}
+
+	if (iterations < 1) {
+		printf("usage: exits [iterations]\n");
+
+		return 1;
+	}
+
+	samples = calloc(iterations, sizeof(*samples));
+	if (!samples) {
+		printf("failed to allocate samples\n");
+
+		return 1;
+	}
+
+	if ((peach_fd = open("/dev/peach", O_RDWR)) < 0) {
+		printf("failed to open Peach device\n");
+		free(samples);
+
+		return 1;
+	}
+
+	/* a window past the fresh memory leaves one store per VM */
+	window = prefault_pages();
+	if ((uint64_t) window * 0x1000 >= FRESH_MEMORY_SIZE) {
+		stride = 0;
+		per_vm = 1;
+	} else {
+		stride = window * 0x1000 / 16;
+		per_vm = FRESH_MEMORY_SIZE / (window * 0x1000);
+	}
+
+	printf("%-10s %8s %10s %10s %10s %12s %14s\n", "exit", "samples",
+		"median", "p99", "max", "host exits", "host cyc/exit");
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		exits = 0;
+		cycles = 0;
+
+		/* the EPT fault kernel runs out of fresh memory soonest */
+		for (done = 0; done < iterations; done += n) {
+			n = iterations - done;
+			if (n > BENCH_MAX_SAMPLES) {
+				n = BENCH_MAX_SAMPLES;
+			}
+
+			if (benches[i].fresh_memory && n > per_vm) {
+				n = per_vm;
+			}
+
+			if (run(&benches[i], n, stride, samples + done,
+						&exits, &cycles) < 0) {
+				close(peach_fd);
+				free(samples);
+
+				return 1;
+			}
+		}
+
+		qsort(samples, iterations, sizeof(*samples), compare);
+
+		/* cycles per exit, both measured by the guest and in the host */
+		printf("%-10s %8d %10u %10u %10u %12llu %14llu\n",
+			benches[i].name, iterations,
+			samples[iterations / 2],
+			samples[(iterations - 1) * 99 / 100],
+			samples[iterations - 1],
+			(unsigned long long) exits,
+			(unsigned long long) (exits ? cycles / exits : 0));
+	}
+
+	close(peach_fd);
+	free(samples);
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Measures how long it takes from PEACH_CREATE_VM until the guest has
+ * executed its first instruction. The guest makes the shutdown hypercall
+ * at 0:0, so the first PEACH_RUN returning PEACH_EXIT_SHUTDOWN marks
+ * that point.
+ *
+ * usage: launch [iterations]
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define USERSPACE 1
+#include "peach.h"
+
+#define GUEST_MEMORY_SIZE 0x1000
+
+static int peach_fd;
+
+/* mov $PEACH_HC_SHUTDOWN, %ax; vmcall */
+static const unsigned char guest_code[] = {
+	0xB8, 0x01, 0x00, 0x0F, 0x01, 0xC1,
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Returns the create-to-first-instruction time in ns, or 0 on failure. */
+static unsigned long long launch(void)
+{
+	int vm_fd;
+	int vcpu_fd;
+
+	unsigned long long start;
+	unsigned long long end = 0;
+
+	void *guest_memory;
+
+	struct peach_memory_region region;
+	struct peach_run run;
+
+	/* the guest image is ready before the clock starts, as a VMM's would be */
+	guest_memory = mmap(NULL, GUEST_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (guest_memory == MAP_FAILED) {
+		printf("failed to allocate guest memory\n");
+
+		goto err0;
+	}
+
+	memcpy(guest_memory, guest_code, sizeof(guest_code));
+
+	start = now_ns();
+
+	if ((vm_fd = ioctl(peach_fd, PEACH_CREATE_VM)) < 0) {
+		printf("failed to exec ioctl PEACH_CREATE_VM\n");
+
+		goto err1;
+	}
+
+	region.slot = 0;
+	region.flags = 0;
+	region.guest_phys_addr = 0;
+	region.memory_size = GUEST_MEMORY_SIZE;
+	region.userspace_addr = (uint64_t) guest_memory;
+	if (ioctl(vm_fd, PEACH_SET_MEMORY_REGION, &region) < 0) {
+		printf("failed to exec ioctl PEACH_SET_MEMORY_REGION\n");
+
+		goto err2;
+	}
+
+	if ((vcpu_fd = ioctl(vm_fd, PEACH_CREATE_VCPU, 0)) < 0) {
+		printf("failed to exec ioctl PEACH_CREATE_VCPU\n");
+
+		goto err2;
+	}
+
+	memset(&run, 0, sizeof(run));
+	if (ioctl(vcpu_fd, PEACH_RUN, &run) < 0) {
+		printf("failed to exec ioctl PEACH_RUN\n");
+
+		goto err3;
+	}
+
+	if (run.exit_reason != PEACH_EXIT_SHUTDOWN) {
+		printf("unexpected exit %u\n", run.exit_reason);
+
+		goto err3;
+	}
+
+	end = now_ns();
+
+err3:
+	close(vcpu_fd);
+
+err2:
+	close(vm_fd);
+
+err1:
+	munmap(guest_memory, GUEST_MEMORY_SIZE);
+
+err0:
+
+	return end ? end - start : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	int iterations = 1000;
+
+	unsigned long long *samples;
+
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+	}
+
+	if (iterations < 1) {
+		printf("usage: launch [iterations]\n");
+
+		return 1;
+	}
+
+	samples = calloc(iterations, sizeof(*samples));
+	if (!samples) {
+		printf("failed to allocate samples\n");
+
+		return 1;
+	}
+
+	if ((peach_fd = open("/dev/peach", O_RDWR)) < 0) {
+		printf("failed to open Peach device\n");
+
+		return 1;
+	}
+
+	/* the first launch on a CPU also pays for cold caches */
+	launch();
+
+	for (i = 0; i < iterations; i++) {
+		samples[i] = launch();
+		if (!samples[i]) {
+			close(peach_fd);
+
+			return 1;
+		}
+	}
+
+	qsort(samples, iterations, sizeof(*samples), compare);
+
+	printf("create to first instruction, %d launches (us)\n", iterations);
+	printf("min %.1f median %.1f p99 %.1f max %.1f\n",
+		samples[0] / 1000.0,
+		samples[iterations / 2] / 1000.0,
+		samples[(iterations - 1) * 99 / 100] / 1000.0,
+		samples[iterations - 1] / 1000.0);
+
+	close(peach_fd);
+	free(samples);
+
+	return 0;
+}
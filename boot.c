@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+
+#define USERSPACE 1
+#include "peach.h"
+#include "boot.h"
+
+#define PAGE_SIZE 0x1000ULL
+
+#define GDT_OFFSET 0x0000
+#define PML4_OFFSET 0x1000
+#define PDPT_OFFSET 0x2000
+#define PD_OFFSET 0x3000
+
+/* the page directories, one per 1G */
+#define NR_PDS 4
+
+#define GDT_CODE64 0x08
+#define GDT_CODE32 0x10
+#define GDT_DATA 0x18
+
+#define PTE_PRESENT 0x001ULL
+#define PTE_WRITE 0x002ULL
+#define PTE_LARGE 0x080ULL
+
+#define CR0_PE 0x00000001ULL
+#define CR0_ET 0x00000010ULL
+#define CR0_NE 0x00000020ULL
+#define CR0_PG 0x80000000ULL
+#define CR4_PAE 0x00000020ULL
+#define EFER_LME 0x00000100ULL
+
+/* base 0, limit 4G, present, DPL 0, accessed */
+static const uint64_t gdt[] = {
+	0,
+	/* GDT_CODE64: execute/read, L */
+	0x00AF9B000000FFFFULL,
+	/* GDT_CODE32: execute/read, D */
+	0x00CF9B000000FFFFULL,
+	/* GDT_DATA: read/write, B */
+	0x00CF93000000FFFFULL,
+};
+
+int boot_setup(struct guest_memory *mem, uint64_t addr, int mode)
+{
+	int i;
+	int j;
+
+	char *tables;
+
+	uint64_t *pml4;
+	uint64_t *pdpt;
+	uint64_t *pd;
+
+	if (mode == BOOT_REAL) {
+		return 0;
+	}
+
+	if (addr & (PAGE_SIZE - 1) || addr < mem->guest_phys_addr ||
+			addr - mem->guest_phys_addr > mem->size ||
+			mem->size - (addr - mem->guest_phys_addr) <
+			BOOT_TABLES_SIZE) {
+		printf("boot tables at 0x%llx do not fit in guest memory\n",
+			(unsigned long long) addr);
+
+		return -1;
+	}
+
+	tables = (char *) mem->host + (addr - mem->guest_phys_addr);
+
+	memset(tables, 0, BOOT_TABLES_SIZE);
+	memcpy(tables + GDT_OFFSET, gdt, sizeof(gdt));
+
+	if (mode != BOOT_LONG) {
+		return 0;
+	}
+
+	pml4 = (uint64_t *) (tables + PML4_OFFSET);
+	pdpt = (uint64_t *) (tables + PDPT_OFFSET);
+
+	pml4[0] = (addr + PDPT_OFFSET) | PTE_PRESENT | PTE_WRITE;
+
+	for (i = 0; i < NR_PDS; i++) {
+		pdpt[i] = (addr + PD_OFFSET + i * PAGE_SIZE) |
+			PTE_PRESENT | PTE_WRITE;
+
+		pd = (uint64_t *) (tables + PD_OFFSET + i * PAGE_SIZE);
+		for (j = 0; j < 512; j++) {
+			pd[j] = ((uint64_t) (i * 512 + j) << 21) |
+				PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+		}
+	}
+
+	return 0;
+}
+
+static void flat_segment(struct peach_segment *segment, uint16_t selector,
+		uint8_t type, int mode)
+{
+	memset(segment, 0, sizeof(*segment));
+
+	segment->base = 0;
+	segment->limit = 0xFFFFFFFF;
+	segment->selector = selector;
+	segment->type = type;
+	segment->present = 1;
+	segment->dpl = 0;
+	segment->s = 1;
+	segment->g = 1;
+
+	/* a 64-bit code segment has L set and D clear */
+	if (mode == BOOT_LONG && selector == GDT_CODE64) {
+		segment->l = 1;
+	} else {
+		segment->db = 1;
+	}
+
+	return;
+}
+
+/* TR and LDTR are left as the vCPU starts with them, the guest has no TSS */
+void boot_sregs(uint64_t addr, int mode, struct peach_sregs *sregs)
+{
+	if (mode == BOOT_REAL) {
+		return;
+	}
+
+	flat_segment(&sregs->cs, mode == BOOT_LONG ? GDT_CODE64 : GDT_CODE32,
+		0xB, mode);
+	flat_segment(&sregs->ds, GDT_DATA, 0x3, mode);
+	flat_segment(&sregs->es, GDT_DATA, 0x3, mode);
+	flat_segment(&sregs->fs, GDT_DATA, 0x3, mode);
+	flat_segment(&sregs->gs, GDT_DATA, 0x3, mode);
+	flat_segment(&sregs->ss, GDT_DATA, 0x3, mode);
+
+	memset(&sregs->gdt, 0, sizeof(sregs->gdt));
+	sregs->gdt.base = addr + GDT_OFFSET;
+	sregs->gdt.limit = sizeof(gdt) - 1;
+
+	/* no IDT, an exception shuts the guest down until it loads one */
+	memset(&sregs->idt, 0, sizeof(sregs->idt));
+
+	sregs->cr0 = CR0_PE | CR0_ET | CR0_NE;
+	sregs->cr3 = 0;
+	sregs->cr4 = 0;
+	sregs->efer = 0;
+
+	if (mode == BOOT_LONG) {
+		sregs->cr0 |= CR0_PG;
+		sregs->cr3 = addr + PML4_OFFSET;
+		sregs->cr4 |= CR4_PAE;
+		sregs->efer |= EFER_LME;
+	}
+
+	return;
+}
@@ -0,0 +1,32 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+
+#include "loader.h"
+
+/* the modes a vCPU can start in */
+#define BOOT_REAL 0
+#define BOOT_PROTECTED 1
+#define BOOT_LONG 2
+
+/* the GDT page, then a PML4, a PDPT and four page directories */
+#define BOOT_TABLES_SIZE 0x7000
+
+struct peach_sregs;
+
+/*
+ * Puts the tables mode needs in mem at the page-aligned guest-physical
+ * addr: a GDT with flat code and data segments and, for long mode, page
+ * tables that identity map the first 4G with 2M pages. Returns 0 on
+ * success or -1 with a message printed.
+ */
+int boot_setup(struct guest_memory *mem, uint64_t addr, int mode);
+
+/*
+ * Changes sregs, as PEACH_GET_SREGS returned them, to start a vCPU in
+ * mode with the tables boot_setup() put at addr.
+ */
+void boot_sregs(uint64_t addr, int mode, struct peach_sregs *sregs);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Shared by the benchmark kernels, which run in real mode. The host sets
+ * ESI to the number of iterations, at most BENCH_MAX_SAMPLES; each one
+ * times the exit it makes with RDTSC and stores the 32-bit difference at
+ * BENCH_SAMPLES + 4 * i. The kernel then makes the shutdown hypercall.
+ * ES, EBP, ESI and EDI belong to the loop.
+ */
+#define BENCH_SAMPLES 0x8000
+#define BENCH_MAX_SAMPLES 0x2000
+
+#define PEACH_HC_SHUTDOWN 1
+
+	.macro BENCH_ENTRY
+	.code16
+	.text
+	.globl _start
+	.type _start, @function
+_start:
+	xor %ax, %ax
+	mov %ax, %es
+	mov $BENCH_SAMPLES, %di
+	.endm
+
+	/* the start of an iteration */
+	.macro BENCH_BEGIN
+1:
+	rdtsc
+	mov %eax, %ebp
+	.endm
+
+	/* the end of the timed part */
+	.macro BENCH_RECORD
+	rdtsc
+	sub %ebp, %eax
+	mov %eax, %es:(%di)
+	add $4, %di
+	.endm
+
+	.macro BENCH_NEXT
+	dec %esi
+	jnz 1b
+
+	mov $PEACH_HC_SHUTDOWN, %ax
+	vmcall
+	.endm
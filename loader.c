@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <elf.h>
+
+#include "loader.h"
+
+#define PAGE_SIZE 0x1000ULL
+
+/* the most program headers an image may have */
+#define MAX_PHDRS 64
+
+static int read_full(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret <= 0) {
+			return -1;
+		}
+
+		buf = (char *) buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Puts filesz bytes from offset in the file at gpa, followed by zeros up
+ * to memsz. Whole pages whose file offset lines up with their address
+ * are mapped from the file rather than copied, so a large image costs a
+ * few mmaps and the guest only ever faults in the pages it touches. Only
+ * the partial pages at either end are read.
+ */
+static int load_segment(int fd, struct guest_memory *mem, uint64_t gpa,
+		uint64_t offset, uint64_t filesz, uint64_t memsz)
+{
+	uint64_t head;
+	uint64_t body = 0;
+
+	char *host;
+
+	if (memsz < filesz || gpa < mem->guest_phys_addr ||
+			gpa - mem->guest_phys_addr > mem->size ||
+			memsz > mem->size - (gpa - mem->guest_phys_addr)) {
+		printf("segment at 0x%llx does not fit in guest memory\n",
+			(unsigned long long) gpa);
+
+		return -1;
+	}
+
+	host = (char *) mem->host + (gpa - mem->guest_phys_addr);
+
+	head = filesz;
+	if (!((gpa ^ offset) & (PAGE_SIZE - 1))) {
+		head = (PAGE_SIZE - (gpa & (PAGE_SIZE - 1))) & (PAGE_SIZE - 1);
+		if (head > filesz) {
+			head = filesz;
+		}
+
+		body = (filesz - head) & ~(PAGE_SIZE - 1);
+	}
+
+	if (read_full(fd, host, head, offset) < 0) {
+		printf("failed to read the guest image\n");
+
+		return -1;
+	}
+
+	if (body && mmap(host + head, body, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd,
+				offset + head) == MAP_FAILED) {
+		printf("failed to map the guest image\n");
+
+		return -1;
+	}
+
+	if (read_full(fd, host + head + body, filesz - head - body,
+				offset + head + body) < 0) {
+		printf("failed to read the guest image\n");
+
+		return -1;
+	}
+
+	memset(host + filesz, 0, memsz - filesz);
+
+	return 0;
+}
+
+/* Loads the PT_LOAD segments of a 32-bit or 64-bit x86 ELF image. */
+static int load_elf(int fd, struct guest_memory *mem, uint64_t *entry)
+{
+	int i;
+	int phnum;
+
+	uint64_t phoff;
+
+	Elf64_Ehdr ehdr;
+	Elf32_Ehdr *ehdr32 = (Elf32_Ehdr *) &ehdr;
+
+	Elf64_Phdr phdrs[MAX_PHDRS];
+	Elf32_Phdr phdrs32[MAX_PHDRS];
+
+	if (read_full(fd, &ehdr, sizeof(ehdr), 0) < 0) {
+		printf("failed to read the ELF header\n");
+
+		return -1;
+	}
+
+	if (ehdr.e_ident[EI_CLASS] == ELFCLASS64 && ehdr.e_machine == EM_X86_64) {
+		phoff = ehdr.e_phoff;
+		phnum = ehdr.e_phnum;
+		*entry = ehdr.e_entry;
+	} else if (ehdr.e_ident[EI_CLASS] == ELFCLASS32 &&
+			ehdr32->e_machine == EM_386) {
+		phoff = ehdr32->e_phoff;
+		phnum = ehdr32->e_phnum;
+		*entry = ehdr32->e_entry;
+	} else {
+		printf("not an x86 ELF image\n");
+
+		return -1;
+	}
+
+	if (phnum > MAX_PHDRS) {
+		printf("too many program headers\n");
+
+		return -1;
+	}
+
+	if (ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
+		if (read_full(fd, phdrs, phnum * sizeof(*phdrs), phoff) < 0) {
+			printf("failed to read the program headers\n");
+
+			return -1;
+		}
+	} else {
+		if (read_full(fd, phdrs32, phnum * sizeof(*phdrs32), phoff) < 0) {
+			printf("failed to read the program headers\n");
+
+			return -1;
+		}
+
+		for (i = 0; i < phnum; i++) {
+			phdrs[i].p_type = phdrs32[i].p_type;
+			phdrs[i].p_offset = phdrs32[i].p_offset;
+			phdrs[i].p_paddr = phdrs32[i].p_paddr;
+			phdrs[i].p_filesz = phdrs32[i].p_filesz;
+			phdrs[i].p_memsz = phdrs32[i].p_memsz;
+		}
+	}
+
+	/* the guest starts with paging off, so physical addresses count */
+	for (i = 0; i < phnum; i++) {
+		if (phdrs[i].p_type != PT_LOAD) {
+			continue;
+		}
+
+		if (load_segment(fd, mem, phdrs[i].p_paddr, phdrs[i].p_offset,
+					phdrs[i].p_filesz, phdrs[i].p_memsz) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int load_image(const char *path, struct guest_memory *mem, uint64_t addr,
+		uint64_t *entry)
+{
+	int fd;
+	int ret;
+
+	unsigned char ident[SELFMAG];
+
+	struct stat st;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		printf("failed to open guest image %s\n", path);
+
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		printf("failed to stat guest image %s\n", path);
+
+		close(fd);
+
+		return -1;
+	}
+
+	if (st.st_size >= SELFMAG && read_full(fd, ident, SELFMAG, 0) == 0 &&
+			!memcmp(ident, ELFMAG, SELFMAG)) {
+		ret = load_elf(fd, mem, entry);
+	} else {
+		ret = load_segment(fd, mem, addr, 0, st.st_size, st.st_size);
+		*entry = addr;
+	}
+
+	/* the mappings keep the file open */
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdint.h>
+
+/* guest-physical memory the VMM has mapped at host */
+struct guest_memory {
+	void *host;
+	uint64_t guest_phys_addr;
+	uint64_t size;
+};
+
+/*
+ * Loads the image at path into mem and sets *entry to where the guest
+ * starts. An ELF image is loaded segment by segment at the physical
+ * addresses it asks for; anything else is taken as a flat binary and
+ * loaded at addr, which is also its entry point. Returns 0 on success
+ * or -1 with a message printed.
+ */
+int load_image(const char *path, struct guest_memory *mem, uint64_t addr,
+		uint64_t *entry);
+
+#endif
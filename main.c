@@ -1,30 +1,428 @@
 #define _GNU_SOURCE
-#include <sched.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #define USERSPACE 1
 #include "peach.h"
+#include "loader.h"
+#include "boot.h"
+
+/* only what the guest touches is ever allocated */
+#define GUEST_MEMORY_SIZE (0x1000 * 4096)
+
+#define DEFAULT_IMAGE "guest/guest.bin"
+
+/* the GDT and page tables, at the end of slot 0; the stack grows below */
+#define BOOT_TABLES (GUEST_MEMORY_SIZE - BOOT_TABLES_SIZE)
+
+/* node numbers the nodemask given to mbind can hold */
+#define MAX_NODES 64
+
+struct vcpu {
+	int id;
+	int fd;
+	/* the CPU the vCPU thread is pinned to, -1 if it is not */
+	int cpu;
+	pthread_t thread;
+};
+
+struct slot {
+	uint64_t guest_phys_addr;
+	uint64_t size;
+	/* the node the slot is bound to, -1 to follow vCPU 0 */
+	int node;
+	void *memory;
+};
 
 static int peach_fd;
+static int vm_fd;
+
+static struct slot slots[] = {
+	{ .guest_phys_addr = 0, .size = GUEST_MEMORY_SIZE, .node = -1 },
+};
+
+static struct peach_coalesced_ring *coalesced_ring;
+static pthread_mutex_t coalesced_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vcpu vcpus[PEACH_MAX_VCPUS];
+
+/* where every vCPU starts, from the guest image */
+static uint64_t guest_entry;
+
+/* and in which mode, BOOT_* */
+static int boot_mode = BOOT_REAL;
+
+/* leaf 0 spells the vendor "peach", anything else comes from the host */
+static struct peach_cpuid_entry cpuid_entries[] = {
+	{ .function = 0, .eax = 0x6368, .ebx = 0x6561, .ecx = 0x70 },
+};
+
+static void usage(void)
+{
+	printf("usage: peach [-c cpu,...] [-m node,...] [-i image] [-l addr] "
+		"[-p mode] [nr_vcpus]\n");
+	printf("  -c  pin vCPU i to the i-th CPU\n");
+	printf("  -m  bind memory slot i to the i-th node, by default\n");
+	printf("      it prefers the node of vCPU 0's CPU\n");
+	printf("  -i  the guest, an ELF image or a flat binary, by default\n");
+	printf("      " DEFAULT_IMAGE "\n");
+	printf("  -l  the guest-physical address a flat binary is loaded\n");
+	printf("      and started at, 0 by default\n");
+	printf("  -p  real, protected or long, the mode the guest starts\n");
+	printf("      in, real by default; the others come with a flat\n");
+	printf("      GDT and, for long, the first 4G identity mapped\n");
+
+	return;
+}
+
+/* Parses a comma-separated list of up to max numbers, returns how many. */
+static int parse_list(const char *s, int *list, int max)
+{
+	int n = 0;
+
+	char *end;
+
+	for (;;) {
+		if (n == max) {
+			return -1;
+		}
+
+		list[n] = strtol(s, &end, 10);
+		if (end == s || list[n] < 0) {
+			return -1;
+		}
+
+		n++;
+
+		if (*end == '\0') {
+			return n;
+		}
+
+		if (*end != ',') {
+			return -1;
+		}
+
+		s = end + 1;
+	}
+}
+
+/* Returns the NUMA node of cpu, or -1 if sysfs does not say. */
+static int cpu_node(int cpu)
+{
+	int node;
+
+	char path[64];
+
+	for (node = 0; node < MAX_NODES; node++) {
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Sets the policy the pages of a slot are allocated with when they are
+ * first touched, and moves the pages that already were. The kernel
+ * counts one bit less of the nodemask than maxnode says.
+ */
+static int bind_slot(struct slot *slot, int node, int mode)
+{
+	unsigned long nodemask = 1UL << node;
+
+	return syscall(SYS_mbind, slot->memory, slot->size, mode,
+			&nodemask, MAX_NODES + 1, MPOL_MF_MOVE);
+}
+
+/*
+ * Handles the writes the guest made to coalesced zones, oldest first. This
+ * runs before every exit is looked at, so the device model sees accesses
+ * in the order the guest made them.
+ */
+static void drain_coalesced_ring(void)
+{
+	struct peach_coalesced_entry *entry;
+
+	pthread_mutex_lock(&coalesced_lock);
+
+	while (coalesced_ring->first != __atomic_load_n(&coalesced_ring->last,
+				__ATOMIC_ACQUIRE)) {
+		entry = &coalesced_ring->entries[coalesced_ring->first];
+
+		printf("coalesced %s write 0x%llx, %u bytes\n",
+			entry->pio ? "port" : "mmio",
+			(unsigned long long) entry->addr, entry->len);
+
+		__atomic_store_n(&coalesced_ring->first,
+			(coalesced_ring->first + 1) % PEACH_COALESCED_MAX,
+			__ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&coalesced_lock);
+}
+
+static void *vcpu_thread(void *arg)
+{
+	struct vcpu *vcpu = arg;
+	struct peach_run run;
+	struct peach_cpuid cpuid;
+	struct peach_regs regs;
+	struct peach_sregs sregs;
+
+	cpu_set_t set;
+
+	/*
+	 * The module allocates the vCPU on the node of the thread that
+	 * creates it, so the vCPU is created after the thread is pinned.
+	 */
+	if (vcpu->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(vcpu->cpu, &set);
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+			printf("vcpu %d: failed to pin to cpu %d\n",
+				vcpu->id, vcpu->cpu);
+
+			return NULL;
+		}
+	}
+
+	if ((vcpu->fd = ioctl(vm_fd, PEACH_CREATE_VCPU, vcpu->id)) < 0) {
+		printf("vcpu %d: failed to exec ioctl PEACH_CREATE_VCPU\n",
+			vcpu->id);
+
+		return NULL;
+	}
+
+	cpuid.nent = sizeof(cpuid_entries) / sizeof(cpuid_entries[0]);
+	cpuid.flags = PEACH_CPUID_HOST_PASSTHROUGH;
+	cpuid.entries = (uint64_t) cpuid_entries;
+	if (ioctl(vcpu->fd, PEACH_SET_CPUID, &cpuid) < 0) {
+		printf("vcpu %d: failed to exec ioctl PEACH_SET_CPUID\n",
+			vcpu->id);
+
+		return NULL;
+	}
+
+	if (ioctl(vcpu->fd, PEACH_GET_REGS, &regs) < 0) {
+		printf("vcpu %d: failed to exec ioctl PEACH_GET_REGS\n",
+			vcpu->id);
+
+		return NULL;
+	}
+
+	regs.rip = guest_entry;
+	if (boot_mode != BOOT_REAL) {
+		regs.rsp = BOOT_TABLES;
+	}
+
+	if (ioctl(vcpu->fd, PEACH_SET_REGS, &regs) < 0) {
+		printf("vcpu %d: failed to exec ioctl PEACH_SET_REGS\n",
+			vcpu->id);
+
+		return NULL;
+	}
+
+	if (boot_mode != BOOT_REAL) {
+		if (ioctl(vcpu->fd, PEACH_GET_SREGS, &sregs) < 0) {
+			printf("vcpu %d: failed to exec ioctl PEACH_GET_SREGS\n",
+				vcpu->id);
+
+			return NULL;
+		}
+
+		boot_sregs(BOOT_TABLES, boot_mode, &sregs);
+		if (ioctl(vcpu->fd, PEACH_SET_SREGS, &sregs) < 0) {
+			printf("vcpu %d: failed to exec ioctl PEACH_SET_SREGS\n",
+				vcpu->id);
+
+			return NULL;
+		}
+	}
+
+	/* no budget, the guest runs until it exits */
+	memset(&run, 0, sizeof(run));
+
+	for (;;) {
+		if (ioctl(vcpu->fd, PEACH_RUN, &run) < 0) {
+			printf("vcpu %d: failed to exec ioctl PEACH_RUN\n",
+				vcpu->id);
+
+			return NULL;
+		}
+
+		drain_coalesced_ring();
+
+		switch (run.exit_reason) {
+		case PEACH_EXIT_INTR:
+			continue;
+
+		/* no devices, reads return 0 */
+		case PEACH_EXIT_IO:
+			printf("vcpu %d: %s port 0x%x, %u bytes\n", vcpu->id,
+				run.io.direction == PEACH_EXIT_IO_OUT ? "out" : "in",
+				run.io.port, run.io.size);
+
+			continue;
+
+		case PEACH_EXIT_MMIO:
+			printf("vcpu %d: mmio %s 0x%llx, %u bytes\n", vcpu->id,
+				run.mmio.is_write ? "write" : "read",
+				(unsigned long long) run.mmio.phys_addr, run.mmio.len);
+
+			continue;
+
+		case PEACH_EXIT_MSR:
+			printf("vcpu %d: %s msr 0x%x\n", vcpu->id,
+				run.msr.is_write ? "wrmsr" : "rdmsr", run.msr.index);
+
+			continue;
+
+		case PEACH_EXIT_SHUTDOWN:
+			printf("vcpu %d: guest shutdown\n", vcpu->id);
+
+			return NULL;
+
+		case PEACH_EXIT_FAIL_ENTRY:
+			printf("vcpu %d: VM entry failed, reason 0x%llx, error %llu\n",
+				vcpu->id,
+				(unsigned long long) run.fail_entry.hardware_entry_failure_reason,
+				(unsigned long long) run.fail_entry.instruction_error);
+
+			return NULL;
+
+		default:
+			printf("vcpu %d: unhandled exit 0x%llx, qualification 0x%llx\n",
+				vcpu->id,
+				(unsigned long long) run.hw.hardware_exit_reason,
+				(unsigned long long) run.hw.exit_qualification);
+
+			return NULL;
+		}
+	}
+}
 
 int main(int argc, char **argv)
 {
+	int i;
 	int ret;
+	int opt;
+	int node;
+	int nr_vcpus = 1;
+	int nr_cpus = 0;
+	int nr_nodes = 0;
+	int nr_slots = sizeof(slots) / sizeof(slots[0]);
+
+	int cpus[PEACH_MAX_VCPUS];
+	int nodes[PEACH_MAX_MEMORY_SLOTS];
+
+	uint64_t load_addr = 0;
+
+	const char *image = DEFAULT_IMAGE;
+
+	char *end;
+
+	struct peach_memory_region region;
+	struct guest_memory mem;
+
+	while ((opt = getopt(argc, argv, "c:m:i:l:p:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_cpus = parse_list(optarg, cpus, PEACH_MAX_VCPUS);
+			if (nr_cpus < 0) {
+				usage();
+
+				goto err0;
+			}
+
+			break;
+
+		case 'm':
+			nr_nodes = parse_list(optarg, nodes, nr_slots);
+			if (nr_nodes < 0) {
+				usage();
+
+				goto err0;
+			}
+
+			break;
+
+		case 'i':
+			image = optarg;
+
+			break;
+
+		case 'l':
+			load_addr = strtoull(optarg, &end, 0);
+			if (end == optarg || *end != '\0') {
+				usage();
+
+				goto err0;
+			}
+
+			break;
+
+		case 'p':
+			if (!strcmp(optarg, "real")) {
+				boot_mode = BOOT_REAL;
+			} else if (!strcmp(optarg, "protected")) {
+				boot_mode = BOOT_PROTECTED;
+			} else if (!strcmp(optarg, "long")) {
+				boot_mode = BOOT_LONG;
+			} else {
+				usage();
+
+				goto err0;
+			}
+
+			break;
+
+		default:
+			usage();
 
-	cpu_set_t mask;
+			goto err0;
+		}
+	}
+
+	if (optind < argc) {
+		nr_vcpus = atoi(argv[optind]);
+	}
 
-	CPU_ZERO(&mask);
-	CPU_SET(1, &mask);
-	if (-1 == sched_setaffinity(0, sizeof mask, &mask)) {
-		printf("failed to set affinity\n");
+	if (nr_vcpus < 1 || nr_vcpus > PEACH_MAX_VCPUS || nr_cpus > nr_vcpus) {
+		usage();
 
 		goto err0;
 	}
 
+	for (i = 0; i < nr_vcpus; i++) {
+		vcpus[i].id = i;
+		vcpus[i].cpu = i < nr_cpus ? cpus[i] : -1;
+	}
+
+	for (i = 0; i < nr_nodes; i++) {
+		if (nodes[i] >= MAX_NODES) {
+			usage();
+
+			goto err0;
+		}
+
+		slots[i].node = nodes[i];
+	}
+
 	if ((peach_fd = open("/dev/peach", O_RDWR)) < 0) {
 		printf("failed to open Peach device\n");
 
@@ -37,13 +435,112 @@ int main(int argc, char **argv)
 		goto err1;
 	}
 
-	if ((ret = ioctl(peach_fd, PEACH_RUN)) < 0) {
-		printf("failed to exec ioctl PEACH_RUN\n");
+	if ((vm_fd = ioctl(peach_fd, PEACH_CREATE_VM)) < 0) {
+		printf("failed to exec ioctl PEACH_CREATE_VM\n");
 
 		goto err1;
 	}
 
-	printf("guest exits\n");
+	coalesced_ring = mmap(NULL, PEACH_COALESCED_RING_SIZE,
+				PROT_READ | PROT_WRITE, MAP_SHARED, vm_fd, 0);
+	if (coalesced_ring == MAP_FAILED) {
+		printf("failed to map the coalesced ring\n");
+
+		goto err2;
+	}
+
+	/* guest RAM is plain memory of ours, shared with the guest */
+	for (i = 0; i < nr_slots; i++) {
+		slots[i].memory = mmap(NULL, slots[i].size,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slots[i].memory == MAP_FAILED) {
+			printf("failed to allocate guest memory\n");
+
+			nr_slots = i;
+
+			goto err3;
+		}
+	}
+
+	mem.host = slots[0].memory;
+	mem.guest_phys_addr = slots[0].guest_phys_addr;
+	mem.size = slots[0].size;
+	if (load_image(image, &mem, load_addr, &guest_entry) < 0) {
+		goto err3;
+	}
+
+	/* after the image, so that the tables win if the two overlap */
+	if (boot_setup(&mem, BOOT_TABLES, boot_mode) < 0) {
+		goto err3;
+	}
+
+	/*
+	 * The loader maps parts of the image over slot 0, and a new mapping
+	 * does not keep the policy of the one it replaces, so the policy of
+	 * each slot is only set now.
+	 */
+	for (i = 0; i < nr_slots; i++) {
+		if (slots[i].node >= 0) {
+			ret = bind_slot(&slots[i], slots[i].node, MPOL_BIND);
+		} else if (vcpus[0].cpu >= 0 &&
+				(node = cpu_node(vcpus[0].cpu)) >= 0) {
+			ret = bind_slot(&slots[i], node, MPOL_PREFERRED);
+		} else {
+			ret = 0;
+		}
+
+		if (ret < 0) {
+			printf("failed to set the node of memory slot %d\n", i);
+
+			goto err3;
+		}
+	}
+
+	for (i = 0; i < nr_slots; i++) {
+		region.slot = i;
+		region.flags = 0;
+		region.guest_phys_addr = slots[i].guest_phys_addr;
+		region.memory_size = slots[i].size;
+		region.userspace_addr = (uint64_t) slots[i].memory;
+		if ((ret = ioctl(vm_fd, PEACH_SET_MEMORY_REGION, &region)) < 0) {
+			printf("failed to exec ioctl PEACH_SET_MEMORY_REGION\n");
+
+			goto err3;
+		}
+	}
+
+	/* every vCPU is driven by a thread of its own, which creates it */
+	for (i = 0; i < nr_vcpus; i++) {
+		if (pthread_create(&vcpus[i].thread, NULL,
+					vcpu_thread, &vcpus[i])) {
+			printf("failed to create vcpu thread\n");
+
+			nr_vcpus = i;
+
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_vcpus; i++) {
+		pthread_join(vcpus[i].thread, NULL);
+	}
+
+	for (i = 0; i < nr_vcpus; i++) {
+		if (vcpus[i].fd > 0) {
+			close(vcpus[i].fd);
+		}
+	}
+
+err3:
+	for (i = 0; i < nr_slots; i++) {
+		munmap(slots[i].memory, slots[i].size);
+	}
+
+	munmap(coalesced_ring, PEACH_COALESCED_RING_SIZE);
+
+err2:
+	close(vm_fd);
 
 err1:
 	close(peach_fd);
@@ -1,5 +0,0 @@
-unsigned char guest_bin[] = {
-  0xb8, 0x00, 0x00, 0x0f, 0xa2, 0x2d, 0x20, 0x20, 0x81, 0xeb, 0x20, 0x20,
-  0x81, 0xe9, 0x20, 0x20, 0xf4
-};
-unsigned int guest_bin_len = 17;
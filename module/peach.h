@@ -7,6 +7,7 @@
 	#include <stdint.h>
 	#define u64 uint64_t
 	#define u32 uint32_t
+	#define u16 uint16_t
 	#define u8 uint8_t
 #else
 	#include <linux/types.h>
@@ -17,8 +18,351 @@
 #define PEACH_MAJOR 511
 #define PEACH_MINOR 0
 
+#define PEACH_MAX_VCPUS 64
+#define PEACH_MAX_MEMORY_SLOTS 32
+#define PEACH_MAX_COALESCED_ZONES 16
+#define PEACH_MAX_CPUID_ENTRIES 256
+
+/* why PEACH_RUN returned, struct peach_run.exit_reason */
+#define PEACH_EXIT_UNKNOWN 0
+/* no longer returned, HLT idles the vCPU in the kernel */
+#define PEACH_EXIT_HLT 1
+/* the guest or PEACH_SHUTDOWN shut the VM down */
+#define PEACH_EXIT_SHUTDOWN 2
+#define PEACH_EXIT_FAIL_ENTRY 3
+#define PEACH_EXIT_INTR 4
+#define PEACH_EXIT_IO 5
+#define PEACH_EXIT_MMIO 6
+#define PEACH_EXIT_MSR 7
+/* the guest used up the budget given to PEACH_RUN */
+#define PEACH_EXIT_TIMER 8
+
+/* struct peach_run.io.direction */
+#define PEACH_EXIT_IO_IN 0
+#define PEACH_EXIT_IO_OUT 1
+
+struct peach_run {
+	u32 exit_reason;
+	u32 padding;
+
+	/*
+	 * Set by userspace: how many TSC cycles the guest may run for in
+	 * this PEACH_RUN before it returns with PEACH_EXIT_TIMER, or 0 for
+	 * no limit. Time the vCPU spends halted does not count.
+	 */
+	u64 budget;
+
+	union {
+		/* PEACH_EXIT_UNKNOWN */
+		struct {
+			u64 hardware_exit_reason;
+			u64 exit_qualification;
+		} hw;
+
+		/* PEACH_EXIT_FAIL_ENTRY */
+		struct {
+			u64 hardware_entry_failure_reason;
+			u64 instruction_error;
+		} fail_entry;
+
+		/*
+		 * PEACH_EXIT_IO, a port access of size bytes that is not
+		 * coalesced. For PEACH_EXIT_IO_IN userspace stores the value
+		 * read in data, and the next PEACH_RUN completes the IN.
+		 */
+		struct {
+			u8 direction;
+			u8 size;
+			u16 port;
+			u32 data;
+		} io;
+
+		/*
+		 * PEACH_EXIT_MMIO, an access of len bytes to guest-physical
+		 * memory that no slot backs and no coalesced zone covers. For
+		 * a read userspace stores the value in data, and the next
+		 * PEACH_RUN completes the instruction.
+		 */
+		struct {
+			u64 phys_addr;
+			u8 data[8];
+			u32 len;
+			u8 is_write;
+		} mmio;
+
+		/*
+		 * PEACH_EXIT_MSR, an RDMSR or WRMSR of index that the MSR
+		 * bitmap does not let through. For an RDMSR userspace stores
+		 * the value in data, and the next PEACH_RUN loads it into
+		 * EDX:EAX.
+		 */
+		struct {
+			u32 index;
+			u8 is_write;
+			u8 padding[3];
+			u64 data;
+		} msr;
+
+		char reserved[256];
+	};
+};
+
+/* struct peach_memory_region.flags */
+#define PEACH_MEM_READONLY (1 << 0)
+#define PEACH_MEM_LOG_DIRTY_PAGES (1 << 1)
+
+/*
+ * Maps memory_size bytes of the calling process, starting at
+ * userspace_addr, into the guest at guest_phys_addr. All three must be
+ * page aligned. A memory_size of 0 deletes the slot. Guest writes to a
+ * PEACH_MEM_READONLY slot exit to userspace. The pages of a
+ * PEACH_MEM_LOG_DIRTY_PAGES slot that the guest writes are recorded
+ * for PEACH_GET_DIRTY_LOG.
+ */
+struct peach_memory_region {
+	u32 slot;
+	u32 flags;
+	u64 guest_phys_addr;
+	u64 memory_size;
+	u64 userspace_addr;
+};
+
+/*
+ * dirty_bitmap points to one bit per page of the slot, rounded up to a
+ * multiple of 64 bits. Bit n is set if the guest wrote the page at
+ * guest_phys_addr + n * 4096 since the previous PEACH_GET_DIRTY_LOG.
+ */
+struct peach_dirty_log {
+	u32 slot;
+	u32 padding;
+	u64 dirty_bitmap;
+};
+
+#define PEACH_STATS_EXIT_REASONS 80
+#define PEACH_STATS_BUCKETS 20
+#define PEACH_STATS_SHIFT 8
+
+/*
+ * VM exits of one basic exit reason. cycles is the TSC time spent in
+ * the host from each exit until the guest was entered again, or until
+ * PEACH_RUN returned. histogram[0] counts the exits that took less than
+ * 2^PEACH_STATS_SHIFT cycles, histogram[n] those that took at least
+ * 2^(PEACH_STATS_SHIFT + n - 1), and the last bucket takes the rest.
+ */
+struct peach_exit_stats {
+	u64 count;
+	u64 cycles;
+	u64 histogram[PEACH_STATS_BUCKETS];
+};
+
+/* indexed by the basic exit reason, bits 15:0 of the VMCS field */
+struct peach_vcpu_stats {
+	struct peach_exit_stats exits[PEACH_STATS_EXIT_REASONS];
+};
+
+/*
+ * Guest writes to [addr, addr + size), guest-physical memory or ports
+ * if pio is set, do not exit. They are appended to the coalesced ring
+ * instead and the guest continues right away. Reads still exit.
+ */
+struct peach_coalesced_zone {
+	u64 addr;
+	u32 size;
+	u32 pio;
+};
+
+struct peach_coalesced_entry {
+	u64 addr;
+	u32 len;
+	u32 pio;
+	u8 data[8];
+};
+
+/*
+ * The ring is PEACH_COALESCED_RING_SIZE bytes at offset 0 of the VM
+ * file descriptor, mapped with mmap(). The kernel appends at last, the
+ * VMM consumes from first and advances it. Entries are in the order
+ * the guest wrote them; the VMM drains the ring before it handles any
+ * exit, so an exit is never seen ahead of writes that came before it.
+ * While the ring is full, writes exit as if they were not coalesced.
+ */
+struct peach_coalesced_ring {
+	u32 first;
+	u32 last;
+	struct peach_coalesced_entry entries[];
+};
+
+#define PEACH_COALESCED_RING_SIZE (4096 * 4)
+#define PEACH_COALESCED_MAX ((PEACH_COALESCED_RING_SIZE - \
+		sizeof(struct peach_coalesced_ring)) / \
+		sizeof(struct peach_coalesced_entry))
+
+/* struct peach_cpuid_entry.flags: the entry only applies to this index */
+#define PEACH_CPUID_FLAG_SIGNIFICANT_INDEX (1 << 0)
+
+/*
+ * What CPUID returns for leaf function, and for subleaf index if the
+ * leaf has subleaves, in EAX and ECX.
+ */
+struct peach_cpuid_entry {
+	u32 function;
+	u32 index;
+	u32 flags;
+	u32 eax;
+	u32 ebx;
+	u32 ecx;
+	u32 edx;
+	u32 padding;
+};
+
+/* struct peach_cpuid.flags: unlisted leaves return what the host's do */
+#define PEACH_CPUID_HOST_PASSTHROUGH (1 << 0)
+
+/*
+ * The CPUID table of a vCPU, nent entries at the user address entries.
+ * It replaces the previous one. Leaves it does not list read as 0, or
+ * as the host CPU's raw values with PEACH_CPUID_HOST_PASSTHROUGH.
+ */
+struct peach_cpuid {
+	u32 nent;
+	u32 flags;
+	u64 entries;
+};
+
+/* struct peach_msr_range.flags, the accesses that run without an exit */
+#define PEACH_MSR_ALLOW_READ (1 << 0)
+#define PEACH_MSR_ALLOW_WRITE (1 << 1)
+
+/*
+ * Sets which accesses to the nmsrs MSRs from base on exit, and go to
+ * userspace as PEACH_EXIT_MSR. Every access exits until allowed here.
+ * Only MSRs 0-0x1FFF and 0xC0000000-0xC0001FFF can be allowed, and
+ * writes only to MSRs whose guest value is switched, by VM entry and
+ * exit or around each PEACH_RUN, so the guest can never change one of
+ * the host's. STAR, LSTAR, CSTAR and SFMASK always exit, and are
+ * handled by the kernel without going to userspace.
+ */
+struct peach_msr_range {
+	u32 base;
+	u32 nmsrs;
+	u32 flags;
+	u32 padding;
+};
+
+/*
+ * Lets IN and OUT on the nports ports from base reach the hardware
+ * without an exit if allow is set, or makes them exit again if not.
+ * Every port exits until allowed here.
+ */
+struct peach_io_range {
+	u32 base;
+	u32 nports;
+	u32 allow;
+	u32 padding;
+};
+
+/*
+ * Hypercalls, made with VMCALL with the number in RAX. The result is
+ * returned in RAX, PEACH_HC_ENOSYS for a number that is not known.
+ */
+#define PEACH_HC_SHUTDOWN 1
+
+#define PEACH_HC_ENOSYS ((u64) -1)
+
+/*
+ * An external interrupt for the vCPU. Vectors 32-255 can be queued; the
+ * highest one queued is delivered as soon as the guest accepts
+ * interrupts, the same vector queued twice before that only once.
+ */
+struct peach_irq {
+	u32 vector;
+	u32 padding;
+};
+
+/*
+ * The general purpose registers, RIP and RFLAGS of a vCPU. Setting them
+ * before the first PEACH_RUN picks where the guest starts; setting them
+ * while an IN, MMIO read or RDMSR is outstanding drops its result.
+ */
+struct peach_regs {
+	u64 rax, rbx, rcx, rdx, rsi, rdi, rsp, rbp;
+	u64 r8, r9, r10, r11, r12, r13, r14, r15;
+	u64 rip, rflags;
+};
+
+/*
+ * A segment register with its hidden part. present clear makes the
+ * segment unusable, which is what a null selector loads outside real
+ * mode.
+ */
+struct peach_segment {
+	u64 base;
+	u32 limit;
+	u16 selector;
+	u8 type;
+	u8 present, dpl, db, s, l, g, avl;
+	u8 padding[3];
+};
+
+struct peach_dtable {
+	u64 base;
+	u16 limit;
+	u16 padding[3];
+};
+
+/*
+ * The segment, descriptor table and control registers of a vCPU, what
+ * mode it is in. A vCPU starts in real mode; setting these before the
+ * first PEACH_RUN starts it in protected or long mode instead, with the
+ * GDT and page tables the VMM put in guest memory. Long mode is entered
+ * with EFER.LME and CR0.PG set, and EFER.LMA follows from them.
+ */
+struct peach_sregs {
+	struct peach_segment cs, ds, es, fs, gs, ss;
+	struct peach_segment tr, ldt;
+	struct peach_dtable gdt, idt;
+	u64 cr0, cr3, cr4, efer;
+};
+
+/*
+ * PEACH_SNAPSHOT saves the state of every vCPU and the contents of every
+ * memory slot in the kernel, replacing the previous snapshot;
+ * PEACH_RESTORE puts them back. Both fail with EBUSY while a vCPU runs.
+ *
+ * Restoring rewrites only the pages the guest wrote since the snapshot
+ * in slots that log dirty pages, and every page the guest touched in
+ * slots that do not. Writes the VMM makes to guest memory itself are not
+ * tracked, so it takes a new snapshot after making them. vCPUs and
+ * slots created after the snapshot are left alone. A PEACH_SNAPSHOT that
+ * fails leaves no snapshot behind, PEACH_RESTORE fails with ENOENT until
+ * the next one succeeds.
+ */
+
 #define PEACH_MAGIC 'M'
 #define PEACH_PROBE _IOR(PEACH_MAGIC, 0, u64)
-#define PEACH_RUN _IO(PEACH_MAGIC, 1)
+#define PEACH_CREATE_VM _IO(PEACH_MAGIC, 2)
+
+/* ioctls on the VM file descriptor returned by PEACH_CREATE_VM */
+#define PEACH_CREATE_VCPU _IO(PEACH_MAGIC, 3)
+#define PEACH_SET_MEMORY_REGION _IOW(PEACH_MAGIC, 4, struct peach_memory_region)
+#define PEACH_GET_DIRTY_LOG _IOW(PEACH_MAGIC, 5, struct peach_dirty_log)
+#define PEACH_REGISTER_COALESCED_ZONE _IOW(PEACH_MAGIC, 7, struct peach_coalesced_zone)
+#define PEACH_UNREGISTER_COALESCED_ZONE _IOW(PEACH_MAGIC, 8, struct peach_coalesced_zone)
+#define PEACH_SET_MSR_RANGE _IOW(PEACH_MAGIC, 10, struct peach_msr_range)
+#define PEACH_SET_IO_RANGE _IOW(PEACH_MAGIC, 11, struct peach_io_range)
+#define PEACH_SHUTDOWN _IO(PEACH_MAGIC, 12)
+#define PEACH_SNAPSHOT _IO(PEACH_MAGIC, 16)
+#define PEACH_RESTORE _IO(PEACH_MAGIC, 17)
+
+/* ioctls on the vCPU file descriptor returned by PEACH_CREATE_VCPU */
+#define PEACH_RUN _IOWR(PEACH_MAGIC, 1, struct peach_run)
+#define PEACH_GET_STATS _IOR(PEACH_MAGIC, 6, struct peach_vcpu_stats)
+#define PEACH_SET_CPUID _IOW(PEACH_MAGIC, 9, struct peach_cpuid)
+/* unlike the others, may be called while another thread runs the vCPU */
+#define PEACH_INJECT_IRQ _IOW(PEACH_MAGIC, 13, struct peach_irq)
+#define PEACH_GET_REGS _IOR(PEACH_MAGIC, 14, struct peach_regs)
+#define PEACH_SET_REGS _IOW(PEACH_MAGIC, 15, struct peach_regs)
+#define PEACH_GET_SREGS _IOR(PEACH_MAGIC, 18, struct peach_sregs)
+#define PEACH_SET_SREGS _IOW(PEACH_MAGIC, 19, struct peach_sregs)
 
 #endif
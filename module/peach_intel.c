@@ -1,14 +1,48 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/types.h>
 #include <linux/mm.h>
 #include <linux/delay.h>
+#include <linux/highmem.h>
+#include <linux/anon_inodes.h>
+#include <linux/bitmap.h>
+#include <linux/bsearch.h>
+#include <linux/idr.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
+#include <linux/user-return-notifier.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include <asm/fpu/api.h>
+#include <asm/fred.h>
+#include <asm/msr.h>
+#include <asm/processor.h>
+#include <asm/processor-flags.h>
+#include <asm/special_insns.h>
+#include <asm/tlbflush.h>
 
 #include "peach.h"
-#include "guest.h"
+#include "vmx.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("ScratchLab");
@@ -16,6 +50,9 @@ MODULE_AUTHOR("ScratchLab");
 static dev_t peach_dev;
 static struct cdev peach_cdev;
 
+/* /sys/kernel/debug/peach, one directory per VM below it */
+static struct dentry *peach_debugfs_dir;
+
 static long peach_ioctl(struct file *file,
 			unsigned int cmd,
 			unsigned long data);
@@ -24,6 +61,28 @@ static struct file_operations peach_fops = {
 	.unlocked_ioctl = peach_ioctl,
 };
 
+static long peach_vm_ioctl(struct file *file,
+			unsigned int cmd,
+			unsigned long data);
+static int peach_vm_mmap(struct file *file, struct vm_area_struct *vma);
+static int peach_vm_release(struct inode *inode, struct file *file);
+static struct file_operations peach_vm_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = peach_vm_ioctl,
+	.mmap = peach_vm_mmap,
+	.release = peach_vm_release,
+};
+
+static long peach_vcpu_ioctl(struct file *file,
+			unsigned int cmd,
+			unsigned long data);
+static int peach_vcpu_release(struct inode *inode, struct file *file);
+static struct file_operations peach_vcpu_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = peach_vcpu_ioctl,
+	.release = peach_vcpu_release,
+};
+
 struct vmcs_hdr {
 	u32 revision_id:31;
 	u32 shadow:1;
@@ -36,25 +95,88 @@ struct vmcs {
 	char data[VMX_SIZE_MAX - 8];
 };
 
-static struct vmcs *vmxon;
-static struct vmcs *vmcs;
+/*
+ * A VMXON region belongs to a logical processor, not to a guest, so
+ * there is one per CPU and every VM running on that CPU shares it.
+ */
+static DEFINE_PER_CPU(struct vmcs *, vmxon);
+
+static DEFINE_IDA(peach_vpid_ida);
+
+/* IA32_VMX_EPT_VPID_CAP, read once when the module is loaded */
+static u64 vmx_ept_vpid_cap;
+/* the narrowest INVEPT type the CPU supports */
+static u64 vmx_invept_type;
+/* the same for INVVPID, if VPIDs are used */
+static u64 vmx_invvpid_type;
+/* log2 of the TSC cycles per tick of the VMX preemption timer */
+static int vmx_preemption_timer_rate;
+/* the size of a guest's XSAVE area, or of its FXSAVE area without XSAVE */
+static unsigned int guest_fpu_size;
+
+/*
+ * The VM-execution, VM-exit and VM-entry controls every VMCS is set up
+ * with, computed once from the VMX capability MSRs.
+ */
+struct vmcs_config {
+	u32 revision_id;
+	u32 pin_based;
+	u32 cpu_based;
+	u32 cpu_based_2nd;
+	u32 vmexit;
+	u32 vmentry;
+};
 
-static u8 *stack;
+static struct vmcs_config vmcs_config;
+
+/*
+ * Guest state that does not depend on the vCPU: a real-mode guest that
+ * starts at 0:0 with all segments flat at 64K. Unrestricted guest lets
+ * it run with CR0.PE and CR0.PG clear.
+ */
+static const struct {
+	u32 field;
+	u64 value;
+} guest_state_table[] = {
+	{ GUEST_CS_SELECTOR, 0x0000 },
+	{ GUEST_TR_SELECTOR, 0x0000 },
+	{ VMCS_LINK_POINTER, 0xFFFFFFFFFFFFFFFF },
+	{ GUEST_CS_LIMIT, 0x0000FFFF },
+	{ GUEST_TR_LIMIT, 0x000000FF },
+	{ GUEST_ES_AR_BYTES, 0x00010000 },
+	{ GUEST_CS_AR_BYTES, 0x0000009B },
+	{ GUEST_SS_AR_BYTES, 0x00010000 },
+	{ GUEST_DS_AR_BYTES, 0x00010000 },
+	{ GUEST_FS_AR_BYTES, 0x00010000 },
+	{ GUEST_GS_AR_BYTES, 0x00010000 },
+	{ GUEST_LDTR_AR_BYTES, 0x00010000 },
+	{ GUEST_TR_AR_BYTES, 0x0000008B },
+	{ GUEST_CR0, 0x00000020 },
+	{ GUEST_CR4, 0x0000000000002000 },
+	{ GUEST_CS_BASE, 0x0000000000000000 },
+	{ GUEST_TR_BASE, 0x0000000000008000 },
+	{ GUEST_RIP, 0x0000000000000000 },
+	{ GUEST_RFLAGS, 0x0000000000000002 },
+};
 
-#define GUEST_MEMORY_SIZE (0x1000 * 16)
-static u8 *guest_memory;
+/* cleared when loading if the CPU cannot log page modifications */
+static bool enable_pml = 1;
+module_param(enable_pml, bool, 0444);
+MODULE_PARM_DESC(enable_pml,
+		"track dirty pages with the page-modification log, not by scanning");
 
-#define EPT_MEMORY_SIZE (0x1000 * 4)
-static unsigned char *ept_memory;
+static unsigned int prefault_pages = 16;
+module_param(prefault_pages, uint, 0644);
+MODULE_PARM_DESC(prefault_pages,
+		"guest pages mapped together with the one an EPT violation hit");
 
-static void init_ept(u64 *ept_pointer, u64 guest_memory_pa);
-static void init_ept_pointer(u64 *p, u64 pa);
-static void init_pml4e(u64 *entry, u64 pa);
-static void init_pdpte(u64 *entry, u64 pa);
-static void init_pde(u64 *entry, u64 pa);
-static void init_pte(u64 *entry, u64 pa);
+static unsigned int halt_poll_ns = 200000;
+module_param(halt_poll_ns, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns,
+		"longest a halted vCPU polls for an event before it sleeps");
 
-void _vmexit_handler(void);
+/* the first poll window of a vCPU whose halts would have been caught by one */
+#define HALT_POLL_START_NS 10000
 
 struct guest_regs {
 	u64 rax;
@@ -74,48 +196,740 @@ struct guest_regs {
 	u64 r14;
 	u64 r15;
 };
+
+/*
+ * A MOV between a register or an immediate and memory, the only kind of
+ * instruction MMIO is emulated for.
+ */
+struct mov_insn {
+	int len;
+	/* operand size in bytes */
+	int size;
+	int is_write;
+	/* x86 register number, -1 for an immediate */
+	int reg;
+	/* 8 for AH, CH, DH and BH */
+	int shift;
+	u64 imm;
+};
+
+/* segment registers, in the order of their VMCS fields */
+enum {
+	SEG_ES,
+	SEG_CS,
+	SEG_SS,
+	SEG_DS,
+	SEG_FS,
+	SEG_GS,
+	SEG_LDTR,
+	SEG_TR,
+};
+
+/*
+ * How the guest translates linear addresses, taken from the VMCS so that
+ * its page tables can be walked after the VMCS is put.
+ */
+struct guest_paging {
+	/* 0 with paging off, 2 for 32-bit paging, 3 for PAE, 4 or 5 */
+	int levels;
+	int pse;
+	u64 cr3;
+	u64 pdptrs[4];
+};
+
+/* the address bits of a PAE or long-mode paging entry */
+#define GUEST_PT_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/*
+ * MSRs of the guest that neither VM entry nor exit switch. The host's
+ * are the same on every CPU and only used on the way to and from user
+ * mode, so a guest's stay in the registers until the CPU returns to user
+ * mode, see peach_on_user_return(). Guest writes to them always exit.
+ * MSR_KERNEL_GS_BASE is not one of them: the host's belongs to the task,
+ * which may be switched out once the vCPU is put.
+ */
+static const u32 syscall_msrs[] = {
+	MSR_STAR, MSR_LSTAR, MSR_CSTAR, MSR_SYSCALL_MASK,
+};
+
+/*
+ * The VMCS fields PEACH_SNAPSHOT saves: the guest-state area the guest
+ * can change, and the event that is to be injected on the next entry.
+ * The VM-entry controls are included for the IA-32e mode guest bit.
+ */
+static const u32 snapshot_fields[] = {
+	GUEST_ES_SELECTOR, GUEST_CS_SELECTOR, GUEST_SS_SELECTOR,
+	GUEST_DS_SELECTOR, GUEST_FS_SELECTOR, GUEST_GS_SELECTOR,
+	GUEST_LDTR_SELECTOR, GUEST_TR_SELECTOR,
+	GUEST_ES_LIMIT, GUEST_CS_LIMIT, GUEST_SS_LIMIT, GUEST_DS_LIMIT,
+	GUEST_FS_LIMIT, GUEST_GS_LIMIT, GUEST_LDTR_LIMIT, GUEST_TR_LIMIT,
+	GUEST_GDTR_LIMIT, GUEST_IDTR_LIMIT,
+	GUEST_ES_AR_BYTES, GUEST_CS_AR_BYTES, GUEST_SS_AR_BYTES,
+	GUEST_DS_AR_BYTES, GUEST_FS_AR_BYTES, GUEST_GS_AR_BYTES,
+	GUEST_LDTR_AR_BYTES, GUEST_TR_AR_BYTES,
+	GUEST_ES_BASE, GUEST_CS_BASE, GUEST_SS_BASE, GUEST_DS_BASE,
+	GUEST_FS_BASE, GUEST_GS_BASE, GUEST_LDTR_BASE, GUEST_TR_BASE,
+	GUEST_GDTR_BASE, GUEST_IDTR_BASE,
+	GUEST_CR0, GUEST_CR3, GUEST_CR4, CR0_READ_SHADOW,
+	GUEST_PDPTR0, GUEST_PDPTR1, GUEST_PDPTR2, GUEST_PDPTR3,
+	GUEST_RSP, GUEST_RIP, GUEST_RFLAGS,
+	GUEST_INTERRUPTIBILITY_INFO,
+	VM_ENTRY_CONTROLS, VM_ENTRY_INTR_INFO_FIELD,
+	VM_ENTRY_EXCEPTION_ERROR_CODE, VM_ENTRY_INSTRUCTION_LEN,
+};
+
+/*
+ * What PEACH_SNAPSHOT saves of a vCPU besides its memory. The FPU state
+ * is saved while the guest's registers are not loaded, so it is GUEST_CR0
+ * with TS set that goes with it.
+ */
+struct peach_vcpu_snapshot {
+	u64 fields[ARRAY_SIZE(snapshot_fields)];
+	u64 efer;
+
+	struct guest_regs regs;
+
+	DECLARE_BITMAP(pending_irqs, 256);
+
+	u32 pending_read;
+	int pending_reg;
+	int pending_shift;
+	int pending_size;
+
+	u64 syscall_msrs[ARRAY_SIZE(syscall_msrs)];
+	u64 kernel_gs_base;
+
+	u32 pkru;
+	u8 fpu[];
+};
+
+struct peach_vm;
+
+#define OUTSIDE_GUEST_MODE 0
+#define IN_GUEST_MODE 1
+
+/*
+ * A virtual processor. Each vCPU has its own VMCS and guest registers
+ * and is driven by whichever thread issues PEACH_RUN on its file
+ * descriptor; VM exits land on that thread's kernel stack.
+ */
+struct peach_vcpu {
+	struct peach_vm *vm;
+	int id;
+
+	struct mutex lock;
+
+	struct vmcs *vmcs;
+	int vpid;
+
+	/* the CPU the VMCS is active on, -1 while it is clear */
+	int cpu;
+	/* on the loaded_vcpus list of cpu while it is not -1 */
+	struct list_head loaded_list;
+
+	/* IN_GUEST_MODE from just before VM entry until the VM exit */
+	int mode;
+
+	/* where a halted vCPU sleeps until peach_vcpu_wake() */
+	wait_queue_head_t wq;
+	/* how long the next halt polls before sleeping, see peach_vcpu_halt() */
+	unsigned int halt_poll_ns;
+	/* the guest halted with interrupts enabled, so one wakes it */
+	int halt_irqs_on;
+
+	/* vectors queued by PEACH_INJECT_IRQ and not delivered yet */
+	DECLARE_BITMAP(pending_irqs, 256);
+	/* interrupt-window exiting is on, a vector waits for the guest */
+	int irq_window;
+	/* the VM's ept_gen when this vCPU last flushed its translations */
+	u64 ept_gen;
+
+	/* the page-modification log, if enable_pml */
+	u64 *pml_buffer;
+	/*
+	 * Set by PEACH_GET_DIRTY_LOG to have the log drained on the next
+	 * exit, cleared once it is. in_run is set while the vCPU is in
+	 * PEACH_RUN, where its log can fill up.
+	 */
+	int pml_drain;
+	int in_run;
+
+	/* TSC cycles left of the budget of this PEACH_RUN, if it has one */
+	u64 budget;
+
+	/*
+	 * The guest's x87, SSE and AVX state while it is not in the
+	 * registers, in XSAVE format, or FXSAVE format without XSAVE.
+	 */
+	void *guest_fpu;
+	/* the guest used the FPU in this PEACH_RUN, its CR0.TS is clear */
+	int fpu_active;
+	/* the registers hold the guest's state, see peach_vcpu_load_fpu() */
+	int fpu_loaded;
+	/* PKRU stays out of guest_fpu, it is switched around each entry */
+	u32 guest_pkru;
+
+	/* the guest's values of syscall_msrs[] */
+	u64 guest_syscall_msrs[ARRAY_SIZE(syscall_msrs)];
+	/*
+	 * The guest's MSR_KERNEL_GS_BASE, and the calling task's, which
+	 * PEACH_RUN reads once. The guest's is in the register from the
+	 * first entry after a load up to peach_vcpu_put().
+	 */
+	u64 guest_kernel_gs_base;
+	u64 host_kernel_gs_base;
+	int msrs_loaded;
+
+	/* guest and control state written, only the host state is missing */
+	int vmcs_ready;
+	/* the VMCS was launched since it was last cleared, use VMRESUME */
+	int launched;
+
+	struct guest_regs regs;
+
+	u32 exit_reason;
+
+	/*
+	 * An IN or MMIO read that went to userspace, PEACH_EXIT_IO or
+	 * PEACH_EXIT_MMIO, or 0 if there is none. The next PEACH_RUN loads
+	 * the data userspace supplied into the register, see
+	 * guest_reg_write().
+	 */
+	u32 pending_read;
+	int pending_reg;
+	int pending_shift;
+	int pending_size;
+
+	/* sorted by function and index, replaced under lock */
+	struct peach_cpuid_entry *cpuid_entries;
+	int cpuid_nent;
+	u32 cpuid_flags;
+
+	/* only written by the thread running the vCPU */
+	struct peach_vcpu_stats *stats;
+
+	/* the state saved by PEACH_SNAPSHOT, if there was one */
+	struct peach_vcpu_snapshot *snapshot;
+};
+
+/*
+ * A range of guest-physical memory backed by pages of the VMM process.
+ * A page is pinned into pages[] the first time the guest touches it and
+ * stays pinned until the slot is deleted. An empty slot has npages == 0.
+ */
+struct peach_memslot {
+	u64 base_gfn;
+	unsigned long npages;
+	unsigned long userspace_addr;
+	u32 flags;
+
+	struct page **pages;
+	/* pages written since the last PEACH_GET_DIRTY_LOG, if logged */
+	unsigned long *dirty_bitmap;
+
+	/* the contents at PEACH_SNAPSHOT, NULL for a page of zeros */
+	struct page **snap_pages;
+	/* pages written since PEACH_SNAPSHOT, if logged */
+	unsigned long *snap_dirty;
+};
+
+/*
+ * Everything a guest owns. A VM lives as long as the anonymous file
+ * returned by PEACH_CREATE_VM or any of its vCPU files, whichever is
+ * released last.
+ */
+struct peach_vm {
+	struct mutex lock;
+	refcount_t users;
+
+	/* protects the memory slots and the EPT paging structures */
+	struct mutex mmu_lock;
+
+	struct peach_memslot memslots[PEACH_MAX_MEMORY_SLOTS];
+
+	u64 *ept_root;
+	u64 ept_pointer;
+	/* bumped whenever a present EPT entry is changed or removed */
+	u64 ept_gen;
+	/*
+	 * CPUs that may still cache translations of the EPT from before
+	 * the last change, flushed by the first vCPU that moves there.
+	 */
+	struct cpumask ept_stale;
+	/* CPUs a vCPU of the VM was ever loaded on, only those can be stale */
+	struct cpumask ran_on;
+	/*
+	 * Paging structures unlinked since the last flush. A vCPU in the
+	 * guest may still walk them until it is kicked out, so they are
+	 * only freed by peach_vm_flush_ept().
+	 */
+	struct list_head ept_freed;
+
+	struct peach_vcpu *vcpus[PEACH_MAX_VCPUS];
+	/* where PEACH_GET_DIRTY_LOG waits for the vCPUs to drain their logs */
+	wait_queue_head_t pml_wq;
+
+	/* set once by PEACH_SHUTDOWN or the guest, every PEACH_RUN ends */
+	int shutdown;
+
+	/* PEACH_SNAPSHOT saved every vCPU and slot, under vm->lock */
+	int snapshot_valid;
+
+	/* protects the coalesced zones and the producer side of the ring */
+	spinlock_t coalesced_lock;
+	int nr_coalesced_zones;
+	struct peach_coalesced_zone coalesced_zones[PEACH_MAX_COALESCED_ZONES];
+	/* PEACH_COALESCED_RING_SIZE bytes, mapped by the VMM */
+	struct peach_coalesced_ring *coalesced_ring;
+
+	/*
+	 * Shared by the VMCSs of all vCPUs; a set bit makes the access
+	 * exit. The I/O bitmap is two pages, bitmaps A and B, with one bit
+	 * per port, and is only there if the CPU can use it.
+	 */
+	unsigned long *msr_bitmap;
+	unsigned long *io_bitmap;
+
+	struct dentry *debugfs_dentry;
+};
+
+/* the vCPU whose VMCS is current on this CPU, if any */
+static DEFINE_PER_CPU(struct peach_vcpu *, current_vcpu);
+/* the vCPUs whose VMCS is active on this CPU, current or not */
+static DEFINE_PER_CPU(struct list_head, loaded_vcpus);
+
+#define HOST_STATE_FIELDS 20
+
+/*
+ * Host state that stays the same for as long as a CPU is online, in the
+ * form it is written to the VMCS. It is captured when the CPU comes
+ * online; the GDT, IDT and TSS of a CPU do not move when it goes
+ * offline and back, so a VMCS loaded here before is still up to date.
+ */
+struct host_state {
+	int nr_fields;
+
+	struct {
+		u32 field;
+		u64 value;
+	} fields[HOST_STATE_FIELDS];
+
+	/* what peach_on_user_return() puts back */
+	u64 syscall_msrs[ARRAY_SIZE(syscall_msrs)];
+};
+
+static DEFINE_PER_CPU(struct host_state, host_state);
+
+/* What syscall_msrs[] hold on a CPU, a guest's until it returns to user. */
+struct syscall_msrs {
+	struct user_return_notifier urn;
+	int registered;
+
+	u64 values[ARRAY_SIZE(syscall_msrs)];
+};
+
+static DEFINE_PER_CPU(struct syscall_msrs, syscall_msrs_cache);
+
+static enum cpuhp_state peach_cpuhp_state;
+
+static struct peach_vm *peach_create_vm(void);
+static void peach_destroy_vm(struct peach_vm *vm);
+static void peach_vm_create_debugfs(struct peach_vm *vm, int fd);
+static void peach_vm_put(struct peach_vm *vm);
+static long peach_vm_create_vcpu(struct peach_vm *vm, unsigned long id);
+static long peach_vm_set_memory_region(struct peach_vm *vm,
+			struct peach_memory_region *region);
+static int peach_create_memslot(struct peach_vm *vm,
+			struct peach_memslot *slot,
+			struct peach_memory_region *region);
+static struct peach_memslot *peach_gfn_to_memslot(struct peach_vm *vm,
+			u64 gfn);
+static unsigned long peach_memslot_pin(struct peach_memslot *slot,
+			unsigned long i, unsigned long n);
+static int peach_memslot_fault(struct peach_vm *vm,
+			struct peach_memslot *slot,
+			u64 gfn);
+static void peach_delete_memslot(struct peach_vm *vm,
+			struct peach_memslot *slot);
+static long peach_vm_get_dirty_log(struct peach_vm *vm,
+			struct peach_dirty_log *log);
+static void peach_memslot_sync_dirty(struct peach_vm *vm,
+			struct peach_memslot *slot);
+static int peach_vm_drain_pml(struct peach_vm *vm);
+static int peach_vm_lock_vcpus(struct peach_vm *vm);
+static void peach_vm_unlock_vcpus(struct peach_vm *vm, int n);
+static long peach_vm_snapshot(struct peach_vm *vm);
+static void peach_vm_free_snapshot(struct peach_vm *vm);
+static long peach_vm_restore(struct peach_vm *vm);
+static int peach_memslot_copy_page(struct peach_memslot *slot,
+			unsigned long i, struct page **copy);
+static int peach_memslot_snapshot(struct peach_memslot *slot);
+static void peach_memslot_restore(struct peach_memslot *slot);
+static void peach_memslot_free_snapshot(struct peach_memslot *slot);
+static long peach_vm_register_coalesced(struct peach_vm *vm,
+			struct peach_coalesced_zone *zone);
+static long peach_vm_unregister_coalesced(struct peach_vm *vm,
+			struct peach_coalesced_zone *zone);
+static int peach_coalesced_append(struct peach_vm *vm, u64 addr, u32 len,
+			u32 pio, u64 data);
+static long peach_vm_set_msr_range(struct peach_vm *vm,
+			struct peach_msr_range *range);
+static long peach_vm_set_io_range(struct peach_vm *vm,
+			struct peach_io_range *range);
+static unsigned long peach_read_guest(struct peach_vm *vm, u64 gpa,
+			void *data, unsigned long len);
+static unsigned long peach_read_guest_virt(struct peach_vm *vm,
+			struct guest_paging *paging, u64 gva, void *data,
+			unsigned long len);
+static void peach_vm_flush_ept(struct peach_vm *vm);
+static void peach_vm_shutdown(struct peach_vm *vm);
+static void peach_vcpu_kick(struct peach_vcpu *vcpu);
+static void peach_vcpu_wake(struct peach_vcpu *vcpu);
+static int peach_vcpu_halt(struct peach_vcpu *vcpu);
+
+static struct peach_vcpu *peach_create_vcpu(struct peach_vm *vm, int id);
+static void peach_destroy_vcpu(struct peach_vcpu *vcpu);
+static long peach_vcpu_set_cpuid(struct peach_vcpu *vcpu,
+			struct peach_cpuid *cpuid);
+static void peach_vcpu_load(struct peach_vcpu *vcpu);
+static void peach_vcpu_put(struct peach_vcpu *vcpu);
+static void peach_vcpu_activate_fpu(struct peach_vcpu *vcpu);
+static void peach_vcpu_deactivate_fpu(struct peach_vcpu *vcpu);
+static void peach_vcpu_load_fpu(struct peach_vcpu *vcpu);
+static void peach_vcpu_save_fpu(struct peach_vcpu *vcpu);
+static int peach_vcpu_take_pml(struct peach_vcpu *vcpu);
+static void peach_vcpu_mark_pml(struct peach_vcpu *vcpu, int first);
+static void peach_vcpu_flush_pml(struct peach_vcpu *vcpu);
+static void peach_vcpu_setup_vmcs(struct peach_vcpu *vcpu);
+static void peach_vcpu_get_regs(struct peach_vcpu *vcpu,
+			struct peach_regs *regs);
+static void peach_vcpu_set_regs(struct peach_vcpu *vcpu,
+			struct peach_regs *regs);
+static void peach_vcpu_get_sregs(struct peach_vcpu *vcpu,
+			struct peach_sregs *sregs);
+static long peach_vcpu_set_sregs(struct peach_vcpu *vcpu,
+			struct peach_sregs *sregs);
+static int peach_read_pdptrs(struct peach_vm *vm, u64 cr3, u64 *pdptrs);
+static void get_segment(int seg, struct peach_segment *segment);
+static void set_segment(int seg, struct peach_segment *segment);
+static int peach_vcpu_snapshot(struct peach_vcpu *vcpu);
+static void peach_vcpu_restore(struct peach_vcpu *vcpu);
+static void peach_vcpu_set_host_state(struct peach_vcpu *vcpu, int moved);
+static void peach_capture_host_state(struct host_state *hs);
+static void peach_vcpu_load_msrs(struct peach_vcpu *vcpu);
+static void peach_vcpu_put_msrs(struct peach_vcpu *vcpu);
+static void peach_write_syscall_msr(int i, u64 value);
+static void peach_on_user_return(struct user_return_notifier *urn);
+static int peach_cpu_online(unsigned int cpu);
+static int peach_cpu_offline(unsigned int cpu);
+static void peach_vcpu_clear(struct peach_vcpu *vcpu);
+static long peach_vcpu_queue_irq(struct peach_vcpu *vcpu,
+			struct peach_irq *irq);
+static void peach_vcpu_inject_irq(struct peach_vcpu *vcpu);
+static void peach_vcpu_reinject(struct peach_vcpu *vcpu);
+static int peach_vcpu_run(struct peach_vcpu *vcpu, struct peach_run *run);
+static void peach_vcpu_account_exit(struct peach_vcpu *vcpu, u64 cycles);
+static void peach_vcpu_complete_read(struct peach_vcpu *vcpu,
+			struct peach_run *run);
+static int handle_vmexit(struct peach_vcpu *vcpu, struct peach_run *run);
+static void skip_emulated_instruction(struct peach_vcpu *vcpu);
+static void skip_instruction(struct peach_vcpu *vcpu, u64 len);
+static void handle_cpuid(struct peach_vcpu *vcpu);
+static int handle_hlt(struct peach_vcpu *vcpu);
+static int handle_vmcall(struct peach_vcpu *vcpu, struct peach_run *run);
+static int handle_io(struct peach_vcpu *vcpu, struct peach_run *run);
+static int handle_msr(struct peach_vcpu *vcpu, struct peach_run *run);
+static int handle_cr(struct peach_vcpu *vcpu);
+static int peach_vcpu_set_cr0(struct peach_vcpu *vcpu, u64 cr0);
+static void peach_vcpu_write_cr0(struct peach_vcpu *vcpu, u64 cr0);
+static void peach_vcpu_inject_gp(struct peach_vcpu *vcpu);
+static int handle_ept_violation(struct peach_vcpu *vcpu,
+			struct peach_run *run);
+static int handle_mmio(struct peach_vcpu *vcpu, struct peach_run *run,
+			u64 gpa, u64 qualification, const u8 *insn, int len,
+			int mode);
+static int decode_mov(const u8 *insn, int len, int mode,
+			struct mov_insn *mov);
+static void guest_get_paging(struct guest_paging *paging);
+static int guest_translate(struct peach_vm *vm, struct guest_paging *paging,
+			u64 gva, u64 *gpa);
+
+static int ept_map_range(struct peach_vm *vm, u64 gpa, u64 hpa, u64 size,
+			u64 prot, int *flush);
+static int ept_unmap_range(struct peach_vm *vm, u64 gpa, u64 size,
+			int *flush);
+static u64 *ept_lookup(struct peach_vm *vm, u64 gpa, int *level);
+static void ept_harvest_dirty(u64 *table, int level, u64 start, u64 end,
+			u64 base, unsigned long *bitmap, int *flush);
+static void ept_clean_dirty(struct peach_vm *vm, struct peach_memslot *slot,
+			int *flush);
+static u64 *ept_alloc_table(u64 pa);
+static void ept_free_table(u64 *table, int level);
+static void ept_defer_free_table(struct peach_vm *vm, u64 *table, int level);
+static void ept_free_deferred(struct peach_vm *vm);
+static void init_ept_pointer(u64 *p, u64 pa);
+static void init_ept_table_entry(u64 *entry, u64 pa);
+static void init_ept_leaf(u64 *entry, u64 pa, u64 prot, int level);
+
+void _vmexit_handler(void);
+int _peach_vcpu_run(struct guest_regs *regs, int launched);
+
 static void dump_guest_regs(struct guest_regs *regs);
 
-static u64 shutdown_rsp;
-static u64 shutdown_rbp;
+/*
+ * Computes a control word with every bit of min and as many bits of opt
+ * as the capability MSR allows: bits clear in its high half must be 0,
+ * bits set in its low half must be 1.
+ */
+static int adjust_vmx_controls(u32 min, u32 opt, u32 msr, u32 *result)
+{
+	u32 edx, eax;
+	u32 ctl;
+
+	rdmsr(msr, eax, edx);
+
+	ctl = min | opt;
+	ctl &= edx;
+	ctl |= eax;
+
+	if (min & ~ctl) {
+		printk("VMX controls 0x%x not supported by MSR 0x%x\n",
+				min & ~ctl, msr);
+
+		return -EIO;
+	}
+
+	*result = ctl;
+
+	return 0;
+}
+
+static int setup_vmcs_config(struct vmcs_config *conf)
+{
+	u32 min, opt;
+	u32 pin_msr, cpu_msr, exit_msr, entry_msr;
+
+	u64 basic;
+
+	rdmsrq(MSR_IA32_VMX_BASIC, basic);
+
+	conf->revision_id = basic & VMX_BASIC_REVISION_ID_MASK;
+
+	/* the TRUE MSRs also allow clearing most default-1 controls */
+	if (basic & VMX_BASIC_TRUE_CTLS) {
+		pin_msr = MSR_IA32_VMX_TRUE_PINBASED_CTLS;
+		cpu_msr = MSR_IA32_VMX_TRUE_PROCBASED_CTLS;
+		exit_msr = MSR_IA32_VMX_TRUE_EXIT_CTLS;
+		entry_msr = MSR_IA32_VMX_TRUE_ENTRY_CTLS;
+	} else {
+		pin_msr = MSR_IA32_VMX_PINBASED_CTLS;
+		cpu_msr = MSR_IA32_VMX_PROCBASED_CTLS;
+		exit_msr = MSR_IA32_VMX_EXIT_CTLS;
+		entry_msr = MSR_IA32_VMX_ENTRY_CTLS;
+	}
+
+	/*
+	 * Host interrupts and NMIs must get the CPU back from the guest,
+	 * an NMI would be delivered through the guest's IDT otherwise. The
+	 * preemption timer is only turned on for runs with a budget.
+	 */
+	min = PIN_BASED_EXT_INTR_MASK | PIN_BASED_NMI_EXITING;
+	opt = PIN_BASED_VMX_PREEMPTION_TIMER;
+	if (adjust_vmx_controls(min, opt, pin_msr, &conf->pin_based)) {
+		return -EIO;
+	}
+
+	/*
+	 * Guest port I/O and MSR accesses reach the hardware only where
+	 * userspace lets them through the bitmaps, without them every one
+	 * exits.
+	 */
+	min = CPU_BASED_HLT_EXITING |
+		CPU_BASED_UNCOND_IO_EXITING |
+		CPU_BASED_ACTIVATE_SECONDARY_CONTROLS;
+	opt = CPU_BASED_USE_IO_BITMAPS |
+		CPU_BASED_USE_MSR_BITMAPS;
+	if (adjust_vmx_controls(min, opt, cpu_msr, &conf->cpu_based)) {
+		return -EIO;
+	}
+
+	/* the guest starts in real mode, without paging of its own */
+	min = SECONDARY_EXEC_ENABLE_EPT |
+		SECONDARY_EXEC_UNRESTRICTED_GUEST;
+	opt = SECONDARY_EXEC_ENABLE_VPID;
+	if (enable_pml) {
+		opt |= SECONDARY_EXEC_ENABLE_PML;
+	}
+	if (adjust_vmx_controls(min, opt, MSR_IA32_VMX_PROCBASED_CTLS2,
+				&conf->cpu_based_2nd)) {
+		return -EIO;
+	}
+
+	/* the host is 64-bit, its interrupts are taken after the exit */
+	min = VM_EXIT_HOST_ADDR_SPACE_SIZE;
+	opt = VM_EXIT_SAVE_IA32_EFER | VM_EXIT_LOAD_IA32_EFER;
+	if (adjust_vmx_controls(min, opt, exit_msr, &conf->vmexit)) {
+		return -EIO;
+	}
+
+	min = 0;
+	opt = VM_ENTRY_LOAD_IA32_EFER;
+	if (adjust_vmx_controls(min, opt, entry_msr, &conf->vmentry)) {
+		return -EIO;
+	}
+
+	/* switching EFER one way only would leak the host's into the guest */
+	if (!(conf->vmentry & VM_ENTRY_LOAD_IA32_EFER) ||
+			!(conf->vmexit & VM_EXIT_LOAD_IA32_EFER)) {
+		conf->vmentry &= ~VM_ENTRY_LOAD_IA32_EFER;
+		conf->vmexit &= ~(VM_EXIT_SAVE_IA32_EFER |
+				VM_EXIT_LOAD_IA32_EFER);
+	}
+
+	return 0;
+}
 
 static int peach_init(void)
 {
+	int cpu;
+	int ret;
+
+	struct vmcs *region;
+
+	u32 edx, eax, ecx;
+
+	u64 misc;
+
 	printk("PEACH INIT\n");
 
+	rdmsrq(MSR_IA32_VMX_EPT_VPID_CAP, vmx_ept_vpid_cap);
+
+	if (!(vmx_ept_vpid_cap & VMX_EPT_PAGE_WALK_4_BIT) ||
+			!(vmx_ept_vpid_cap & VMX_EPTP_WB_BIT)) {
+		printk("4-level write-back EPT is not supported\n");
+
+		return -1;
+	}
+
+	/* the log is fed by the EPT dirty flags being set */
+	if (!(vmx_ept_vpid_cap & VMX_EPT_AD_BIT)) {
+		enable_pml = 0;
+	}
+
+	if (setup_vmcs_config(&vmcs_config)) {
+		return -EIO;
+	}
+
+	if (!(vmcs_config.cpu_based_2nd & SECONDARY_EXEC_ENABLE_PML)) {
+		enable_pml = 0;
+	}
+
+	rdmsrq(MSR_IA32_VMX_MISC, misc);
+	vmx_preemption_timer_rate = misc & VMX_MISC_PREEMPTION_TIMER_RATE_MASK;
+
+	/* the guest runs with the host's XCR0, so it needs as much room */
+	guest_fpu_size = 512;
+	if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+		cpuid_count(0xD, 0, &eax, &guest_fpu_size, &ecx, &edx);
+	}
+
+	if (vmx_ept_vpid_cap & VMX_EPT_EXTENT_CONTEXT_BIT) {
+		vmx_invept_type = VMX_EPT_EXTENT_CONTEXT;
+	} else {
+		vmx_invept_type = VMX_EPT_EXTENT_GLOBAL;
+	}
+
+	/* a VPID whose translations cannot be flushed is no use */
+	if (!(vmx_ept_vpid_cap & VMX_VPID_INVVPID_BIT)) {
+		vmcs_config.cpu_based_2nd &= ~SECONDARY_EXEC_ENABLE_VPID;
+	} else if (vmx_ept_vpid_cap & VMX_VPID_EXTENT_SINGLE_CONTEXT_BIT) {
+		vmx_invvpid_type = VMX_VPID_EXTENT_SINGLE_CONTEXT;
+	} else if (vmx_ept_vpid_cap & VMX_VPID_EXTENT_ALL_CONTEXT_BIT) {
+		vmx_invvpid_type = VMX_VPID_EXTENT_ALL_CONTEXT;
+	} else {
+		vmcs_config.cpu_based_2nd &= ~SECONDARY_EXEC_ENABLE_VPID;
+	}
+
+	for_each_possible_cpu(cpu) {
+		region = (struct vmcs *) kzalloc_node(4096, GFP_KERNEL,
+				cpu_to_node(cpu));
+		if (!region) {
+			printk("vmxon region allocation error\n");
+
+			goto err0;
+		}
+
+		region->hdr.revision_id = vmcs_config.revision_id;
+		region->hdr.shadow = 0x00000000;
+		per_cpu(vmxon, cpu) = region;
+	}
+
+	/* VMX is on, and host state captured, on every online CPU */
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "peach:online",
+			peach_cpu_online, peach_cpu_offline);
+	if (ret < 0) {
+		printk("cpuhp_setup_state error\n");
+
+		goto err0;
+	}
+	peach_cpuhp_state = ret;
+
 	peach_dev = MKDEV(PEACH_MAJOR, PEACH_MINOR);
 	if (0 < register_chrdev_region(peach_dev, PEACH_COUNT, "peach")) {
 		printk("register_chrdev_region error\n");
 
-		goto err0;
+		goto err1;
 	}
 
+	/* statistics are optional, a missing debugfs is not an error */
+	peach_debugfs_dir = debugfs_create_dir("peach", NULL);
+
 	cdev_init(&peach_cdev, &peach_fops);
 	peach_cdev.owner = THIS_MODULE;
 
 	if (0 < cdev_add(&peach_cdev, peach_dev, 1)) {
 		printk("cdev_add error\n");
 
-		goto err1;
+		goto err2;
 	}
 
 	return 0;
 
-err1:
+err2:
 	unregister_chrdev_region(peach_dev, 1);
 
+err1:
+	cpuhp_remove_state(peach_cpuhp_state);
+
 err0:
+	debugfs_remove_recursive(peach_debugfs_dir);
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(vmxon, cpu));
+		per_cpu(vmxon, cpu) = NULL;
+	}
 
 	return -1;
 }
 
 static void peach_exit(void)
 {
+	int cpu;
+
 	printk("PEACH EXIT\n");
 
 	cdev_del(&peach_cdev);
 	unregister_chrdev_region(peach_dev, 1);
 
+	debugfs_remove_recursive(peach_debugfs_dir);
+
+	cpuhp_remove_state(peach_cpuhp_state);
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(vmxon, cpu));
+		per_cpu(vmxon, cpu) = NULL;
+	}
+
 	return;
 }
 
@@ -123,26 +937,14 @@ static long peach_ioctl(struct file *file,
 			unsigned int cmd,
 			unsigned long arg)
 {
-	int i;
+	long ret = 0;
 
-	u8 ret1;
+	int fd;
 
 	u32 edx, eax, ecx;
-	u64 rdx;
-
-	u64 vmcs_pa;
-	u64 vmxon_pa;
-
-	u8 xdtr[10];
-	u64 vmcs_field;
-	u64 vmcs_field_value;
-
-	u64 host_tr_selector;
-	u64 host_gdt_base;
-	u64 host_tr_desc;
 
-	u64 ept_pointer;
-	u64 guest_memory_pa;
+	struct peach_vm *vm;
+	struct file *vm_file;
 
 	switch (cmd) {
 	case PEACH_PROBE:
@@ -245,814 +1047,4798 @@ static long peach_ioctl(struct file *file,
 
 		break;
 
-	case PEACH_RUN:
-		printk("PEACH RUN\n");
+	case PEACH_CREATE_VM:
+		printk("PEACH CREATE VM\n");
 
-		guest_memory = (u8 *) kmalloc(GUEST_MEMORY_SIZE,
-							GFP_KERNEL);
-		guest_memory_pa = __pa(guest_memory);
+		vm = peach_create_vm();
+		if (!vm) {
+			ret = -ENOMEM;
 
-		for (i = 0; i < guest_bin_len; i++) {
-			guest_memory[i] = guest_bin[i];
+			break;
 		}
 
-		init_ept(&ept_pointer, guest_memory_pa);
+		/*
+		 * The fd is installed last: once it is, another thread can
+		 * close it and drop the VM before setup is finished.
+		 */
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fd < 0) {
+			peach_destroy_vm(vm);
+			ret = fd;
 
-		vmxon = (struct vmcs *) kmalloc(4096, GFP_KERNEL);
-		memset(vmxon, 0, 4096);
-		vmxon->hdr.revision_id = 0x00000001;
-		vmxon->hdr.shadow = 0x00000000;
-		vmxon_pa = __pa(vmxon);
+			break;
+		}
 
-		vmcs = (struct vmcs *) kmalloc(4096, GFP_KERNEL);
-		memset(vmcs, 0, 4096);
-		vmcs->hdr.revision_id = 0x00000001;
-		vmcs->hdr.shadow = 0x00000000;
-		vmcs_pa = __pa(vmcs);
+		vm_file = anon_inode_getfile("peach-vm", &peach_vm_fops, vm,
+					O_RDWR);
+		if (IS_ERR(vm_file)) {
+			put_unused_fd(fd);
+			peach_destroy_vm(vm);
+			ret = PTR_ERR(vm_file);
 
-		asm volatile (
-			"movq %cr4, %rax\n\t"
-			"bts $13, %rax\n\t"
-			"movq %rax, %cr4"
-		);
+			break;
+		}
 
-		asm volatile (
-			"vmxon %[pa]; setna %[ret]"
-			: [ret] "=rm" (ret1)
-			: [pa] "m" (vmxon_pa)
-			: "cc", "memory"
-		);
-		printk("vmxon = %d\n", ret1);
+		peach_vm_create_debugfs(vm, fd);
 
-		asm volatile (
-			"vmclear %[pa]; setna %[ret]"
-			: [ret] "=rm" (ret1)
-			: [pa] "m" (vmcs_pa)
-			: "cc", "memory"
-		);
-		printk("vmclear = %d\n", ret1);
+		fd_install(fd, vm_file);
+		ret = fd;
 
-		asm volatile (
-			"vmptrld %[pa]; setna %[ret]"
-			: [ret] "=rm" (ret1)
-			: [pa] "m" (vmcs_pa)
-			: "cc", "memory"
-		);
-		printk("vmptrld = %d\n", ret1);
+		break;
 
-		vmcs_field = 0x00000802;
-		vmcs_field_value = 0x0000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CS selctor = 0x%llx\n", vmcs_field_value);
+	default:
+		ret = -ENOTTY;
 
-		vmcs_field = 0x0000080E;
-		vmcs_field_value = 0x0000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest TR selctor = 0x%llx\n", vmcs_field_value);
+		break;
+	}
 
-		vmcs_field = 0x00002800;
-		vmcs_field_value = 0xFFFFFFFFFFFFFFFF;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("VMCS link pointer = 0x%llx\n", vmcs_field_value);
+	return ret;
+}
 
-		vmcs_field = 0x00004802;
-		vmcs_field_value = 0x0000FFFF;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CS limit = 0x%llx\n", vmcs_field_value);
+static long peach_vm_ioctl(struct file *file,
+			unsigned int cmd,
+			unsigned long arg)
+{
+	long ret = 0;
 
-		vmcs_field = 0x0000480E;
-		vmcs_field_value = 0x0000000FF;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest TR limit = 0x%llx\n", vmcs_field_value);
+	struct peach_memory_region region;
+	struct peach_dirty_log log;
+	struct peach_coalesced_zone zone;
+	struct peach_msr_range msr_range;
+	struct peach_io_range io_range;
 
-		vmcs_field = 0x00004814;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest ES access rights = 0x%llx\n", vmcs_field_value);
+	struct peach_vm *vm = file->private_data;
 
-		vmcs_field = 0x00004816;
-		vmcs_field_value = 0x0000009B;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CS access rights = 0x%llx\n", vmcs_field_value);
+	switch (cmd) {
+	case PEACH_CREATE_VCPU:
+		printk("PEACH CREATE VCPU\n");
 
-		vmcs_field = 0x00004818;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest SS access rights = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_create_vcpu(vm, arg);
 
-		vmcs_field = 0x0000481A;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest DS access rights = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x0000481C;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest FS access rights = 0x%llx\n", vmcs_field_value);
+	case PEACH_SET_MEMORY_REGION:
+		if (copy_from_user(&region, (void __user *) arg,
+					sizeof(region))) {
+			ret = -EFAULT;
 
-		vmcs_field = 0x0000481E;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest GS access rights = 0x%llx\n", vmcs_field_value);
+			break;
+		}
 
-		vmcs_field = 0x00004820;
-		vmcs_field_value = 0x00010000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest LDTR access rights = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_set_memory_region(vm, &region);
 
-		vmcs_field = 0x00004822;
-		vmcs_field_value = 0x0000008B;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest TR access rights = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field =  0x00006800;
-		vmcs_field_value = 0x00000020;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CR0 = 0x%llx\n", vmcs_field_value);
+	case PEACH_GET_DIRTY_LOG:
+		if (copy_from_user(&log, (void __user *) arg, sizeof(log))) {
+			ret = -EFAULT;
 
-		vmcs_field =  0x00006804;
-		vmcs_field_value = 0x0000000000002000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CR4 = 0x%llx\n", vmcs_field_value);
+			break;
+		}
 
-		vmcs_field =  0x00006808;
-		vmcs_field_value = 0x0000000000000000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest CS base = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_get_dirty_log(vm, &log);
 
-		vmcs_field =  0x00006814;
-		vmcs_field_value = 0x0000000000008000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest TR base = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x0000681E;
-		vmcs_field_value = 0x0000000000000000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest RIP = 0x%llx\n", vmcs_field_value);
+	case PEACH_REGISTER_COALESCED_ZONE:
+		if (copy_from_user(&zone, (void __user *) arg, sizeof(zone))) {
+			ret = -EFAULT;
 
-		vmcs_field = 0x00006820;
-		vmcs_field_value = 0x0000000000000002;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Guest RFLAGS = 0x%llx\n", vmcs_field_value);
+			break;
+		}
 
-		vmcs_field = 0x00000C00;
-		asm volatile (
-			"movq %%es, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host ES selctor = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_register_coalesced(vm, &zone);
 
-		vmcs_field = 0x00000C02;
-		asm volatile (
-			"movq %%cs, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host CS selctor = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x00000C04;
-		asm volatile (
-			"movq %%ss, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host SS selctor = 0x%llx\n", vmcs_field_value);
+	case PEACH_UNREGISTER_COALESCED_ZONE:
+		if (copy_from_user(&zone, (void __user *) arg, sizeof(zone))) {
+			ret = -EFAULT;
 
-		vmcs_field = 0x00000C06;
-		asm volatile (
-			"movq %%ds, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host DS selctor = 0x%llx\n", vmcs_field_value);
+			break;
+		}
 
-		vmcs_field = 0x00000C08;
-		asm volatile (
-			"movq %%fs, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host FS selctor = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_unregister_coalesced(vm, &zone);
 
-		vmcs_field = 0x00000C0A;
-		asm volatile (
-			"movq %%gs, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host GS selctor = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x00000C0C;
-		asm volatile (
-			"str %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		vmcs_field_value &= 0xF8;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host TR selctor = 0x%llx\n", vmcs_field_value);
+	case PEACH_SET_MSR_RANGE:
+		if (copy_from_user(&msr_range, (void __user *) arg,
+					sizeof(msr_range))) {
+			ret = -EFAULT;
 
-		vmcs_field = 0x00002C00;
-		ecx = 0x277;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_PAT = 0x%llx\n", vmcs_field_value);
+			break;
+		}
 
-		vmcs_field = 0x00002C02;
-		ecx = 0xC0000080;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_EFER = 0x%llx\n", vmcs_field_value);
+		ret = peach_vm_set_msr_range(vm, &msr_range);
 
-		vmcs_field = 0x00002C04;
-		ecx = 0x38F;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_PERF_GLOBAL_CTRL = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x00004C00;
-		ecx = 0x174;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_SYSENTER_CS = 0x%llx\n", vmcs_field_value);
+	case PEACH_SET_IO_RANGE:
+		if (copy_from_user(&io_range, (void __user *) arg,
+					sizeof(io_range))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		ret = peach_vm_set_io_range(vm, &io_range);
+
+		break;
+
+	case PEACH_SHUTDOWN:
+		peach_vm_shutdown(vm);
+
+		break;
+
+	case PEACH_SNAPSHOT:
+		ret = peach_vm_snapshot(vm);
+
+		break;
+
+	case PEACH_RESTORE:
+		ret = peach_vm_restore(vm);
+
+		break;
+
+	default:
+		ret = -ENOTTY;
+
+		break;
+	}
+
+	return ret;
+}
+
+/* The coalesced ring is the only thing to map, at offset 0. */
+static int peach_vm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct peach_vm *vm = file->private_data;
+
+	if (vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+	return remap_vmalloc_range(vma, vm->coalesced_ring, 0);
+}
+
+static int peach_vm_release(struct inode *inode, struct file *file)
+{
+	struct peach_vm *vm = file->private_data;
+
+	printk("PEACH VM RELEASE\n");
+
+	peach_vm_put(vm);
+
+	return 0;
+}
+
+static long peach_vcpu_ioctl(struct file *file,
+			unsigned int cmd,
+			unsigned long arg)
+{
+	long ret = 0;
+
+	struct peach_run run;
+	struct peach_cpuid cpuid;
+	struct peach_irq irq;
+	struct peach_regs regs;
+	struct peach_sregs sregs;
+
+	struct peach_vcpu *vcpu = file->private_data;
+
+	switch (cmd) {
+	case PEACH_RUN:
+		if (copy_from_user(&run, (void __user *) arg, sizeof(run))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		mutex_lock(&vcpu->lock);
+		ret = peach_vcpu_run(vcpu, &run);
+		mutex_unlock(&vcpu->lock);
+
+		if (!ret && copy_to_user((void __user *) arg, &run, sizeof(run))) {
+			ret = -EFAULT;
+		}
+
+		break;
+
+	case PEACH_GET_STATS:
+		/* lock-free, a running vCPU may be halfway through an update */
+		if (copy_to_user((void __user *) arg, vcpu->stats,
+					sizeof(*vcpu->stats))) {
+			ret = -EFAULT;
+		}
+
+		break;
+
+	case PEACH_SET_CPUID:
+		if (copy_from_user(&cpuid, (void __user *) arg, sizeof(cpuid))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		ret = peach_vcpu_set_cpuid(vcpu, &cpuid);
+
+		break;
+
+	case PEACH_INJECT_IRQ:
+		/* no vcpu->lock, PEACH_RUN holds it for as long as the guest runs */
+		if (copy_from_user(&irq, (void __user *) arg, sizeof(irq))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		ret = peach_vcpu_queue_irq(vcpu, &irq);
+
+		break;
+
+	case PEACH_GET_REGS:
+		mutex_lock(&vcpu->lock);
+		peach_vcpu_get_regs(vcpu, &regs);
+		mutex_unlock(&vcpu->lock);
+
+		if (copy_to_user((void __user *) arg, &regs, sizeof(regs))) {
+			ret = -EFAULT;
+		}
+
+		break;
+
+	case PEACH_SET_REGS:
+		if (copy_from_user(&regs, (void __user *) arg, sizeof(regs))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		mutex_lock(&vcpu->lock);
+		peach_vcpu_set_regs(vcpu, &regs);
+		mutex_unlock(&vcpu->lock);
+
+		break;
+
+	case PEACH_GET_SREGS:
+		mutex_lock(&vcpu->lock);
+		peach_vcpu_get_sregs(vcpu, &sregs);
+		mutex_unlock(&vcpu->lock);
+
+		if (copy_to_user((void __user *) arg, &sregs, sizeof(sregs))) {
+			ret = -EFAULT;
+		}
+
+		break;
+
+	case PEACH_SET_SREGS:
+		if (copy_from_user(&sregs, (void __user *) arg, sizeof(sregs))) {
+			ret = -EFAULT;
+
+			break;
+		}
+
+		mutex_lock(&vcpu->lock);
+		ret = peach_vcpu_set_sregs(vcpu, &sregs);
+		mutex_unlock(&vcpu->lock);
+
+		break;
+
+	default:
+		ret = -ENOTTY;
+
+		break;
+	}
+
+	return ret;
+}
+
+static int peach_vcpu_release(struct inode *inode, struct file *file)
+{
+	struct peach_vcpu *vcpu = file->private_data;
+
+	printk("PEACH VCPU RELEASE\n");
+
+	/* the vCPU itself goes away with its VM */
+	peach_vm_put(vcpu->vm);
+
+	return 0;
+}
+
+static struct peach_vm *peach_create_vm(void)
+{
+	struct peach_vm *vm;
+
+	vm = (struct peach_vm *) kzalloc(sizeof(*vm), GFP_KERNEL);
+	if (!vm) {
+		goto err0;
+	}
+
+	mutex_init(&vm->lock);
+	mutex_init(&vm->mmu_lock);
+	spin_lock_init(&vm->coalesced_lock);
+	INIT_LIST_HEAD(&vm->ept_freed);
+	init_waitqueue_head(&vm->pml_wq);
+	refcount_set(&vm->users, 1);
+
+	vm->coalesced_ring = vmalloc_user(PEACH_COALESCED_RING_SIZE);
+	if (!vm->coalesced_ring) {
+		goto err1;
+	}
+
+	/* guest memory is added later with PEACH_SET_MEMORY_REGION */
+	vm->ept_root = (u64 *) get_zeroed_page(GFP_KERNEL_ACCOUNT);
+	if (!vm->ept_root) {
+		goto err1;
+	}
+
+	init_ept_pointer(&vm->ept_pointer, __pa(vm->ept_root));
+
+	/* the root page may have been the root of a VM that is gone */
+	cpumask_setall(&vm->ept_stale);
+
+	if (vmcs_config.cpu_based & CPU_BASED_USE_MSR_BITMAPS) {
+		vm->msr_bitmap = (unsigned long *) __get_free_page(
+				GFP_KERNEL_ACCOUNT);
+		if (!vm->msr_bitmap) {
+			goto err1;
+		}
+
+		memset(vm->msr_bitmap, 0xFF, PAGE_SIZE);
+	}
+
+	if (vmcs_config.cpu_based & CPU_BASED_USE_IO_BITMAPS) {
+		vm->io_bitmap = (unsigned long *) __get_free_pages(
+				GFP_KERNEL_ACCOUNT, 1);
+		if (!vm->io_bitmap) {
+			goto err1;
+		}
+
+		memset(vm->io_bitmap, 0xFF, 2 * PAGE_SIZE);
+	}
+
+	return vm;
+
+err1:
+	peach_destroy_vm(vm);
+
+err0:
+
+	return NULL;
+}
+
+static void peach_destroy_vm(struct peach_vm *vm)
+{
+	int i;
+
+	/* waits for readers of the vCPU files, which use the vCPUs */
+	debugfs_remove_recursive(vm->debugfs_dentry);
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		if (vm->vcpus[i]) {
+			peach_destroy_vcpu(vm->vcpus[i]);
+			vm->vcpus[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		if (vm->memslots[i].npages) {
+			peach_delete_memslot(vm, &vm->memslots[i]);
+		}
+	}
+
+	/* no vCPU is left to walk them */
+	ept_free_deferred(vm);
+
+	if (vm->ept_root) {
+		ept_free_table(vm->ept_root, EPT_LEVELS);
+	}
+
+	if (vm->msr_bitmap) {
+		free_page((unsigned long) vm->msr_bitmap);
+	}
+
+	if (vm->io_bitmap) {
+		free_pages((unsigned long) vm->io_bitmap, 1);
+	}
+
+	vfree(vm->coalesced_ring);
+	kfree(vm);
+
+	return;
+}
+
+static int peach_vcpu_stats_show(struct seq_file *m, void *v)
+{
+	int i;
+	int j;
+
+	struct peach_vcpu *vcpu = m->private;
+	struct peach_exit_stats *exit;
+
+	seq_printf(m, "%6s %12s %12s  histogram of log2 cycles from %d\n",
+			"reason", "count", "avg cycles", PEACH_STATS_SHIFT);
+
+	for (i = 0; i < PEACH_STATS_EXIT_REASONS; i++) {
+		exit = &vcpu->stats->exits[i];
+		if (!exit->count) {
+			continue;
+		}
+
+		seq_printf(m, "%6d %12llu %12llu ", i, exit->count,
+				exit->cycles / exit->count);
+
+		for (j = 0; j < PEACH_STATS_BUCKETS; j++) {
+			seq_printf(m, " %llu", exit->histogram[j]);
+		}
+
+		seq_puts(m, "\n");
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(peach_vcpu_stats);
+
+/* named after the creating process and the VM fd, as KVM does */
+static void peach_vm_create_debugfs(struct peach_vm *vm, int fd)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%d-%d", task_pid_nr(current), fd);
+
+	vm->debugfs_dentry = debugfs_create_dir(name, peach_debugfs_dir);
+
+	return;
+}
+
+static void peach_vm_put(struct peach_vm *vm)
+{
+	if (refcount_dec_and_test(&vm->users)) {
+		peach_destroy_vm(vm);
+	}
+
+	return;
+}
+
+static long peach_vm_create_vcpu(struct peach_vm *vm, unsigned long id)
+{
+	long ret;
+	int fd;
+
+	char name[16];
+
+	struct peach_vcpu *vcpu;
+	struct file *file;
+
+	if (id >= PEACH_MAX_VCPUS) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&vm->lock);
+
+	if (vm->vcpus[id]) {
+		ret = -EEXIST;
+
+		goto err0;
+	}
+
+	vcpu = peach_create_vcpu(vm, id);
+	if (!vcpu) {
+		ret = -ENOMEM;
+
+		goto err0;
+	}
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		peach_destroy_vcpu(vcpu);
+		ret = fd;
+
+		goto err0;
+	}
+
+	file = anon_inode_getfile("peach-vcpu", &peach_vcpu_fops, vcpu,
+				O_RDWR);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		peach_destroy_vcpu(vcpu);
+		ret = PTR_ERR(file);
+
+		goto err0;
+	}
+
+	/* every vCPU file keeps the VM alive */
+	refcount_inc(&vm->users);
+
+	vm->vcpus[id] = vcpu;
+
+	snprintf(name, sizeof(name), "vcpu%lu", id);
+	debugfs_create_file(name, 0444, vm->debugfs_dentry, vcpu,
+			&peach_vcpu_stats_fops);
+
+	/* last, closing the fd from another thread drops the VM */
+	fd_install(fd, file);
+	ret = fd;
+
+err0:
+	mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+static long peach_vm_set_memory_region(struct peach_vm *vm,
+			struct peach_memory_region *region)
+{
+	int i;
+	long ret = 0;
+
+	u64 start;
+	u64 end;
+
+	struct peach_memslot *slot;
+	struct peach_memslot *other;
+
+	if (region->slot >= PEACH_MAX_MEMORY_SLOTS ||
+			region->flags & ~(PEACH_MEM_READONLY |
+				PEACH_MEM_LOG_DIRTY_PAGES)) {
+		return -EINVAL;
+	}
+
+	/* dirty pages are found through the EPT dirty flags */
+	if (region->flags & PEACH_MEM_LOG_DIRTY_PAGES &&
+			!(vmx_ept_vpid_cap & VMX_EPT_AD_BIT)) {
+		return -EOPNOTSUPP;
+	}
+
+	if (!PAGE_ALIGNED(region->guest_phys_addr) ||
+			!PAGE_ALIGNED(region->memory_size) ||
+			!PAGE_ALIGNED(region->userspace_addr)) {
+		return -EINVAL;
+	}
+
+	/* a 4-level EPT translates 48 bits of guest-physical address */
+	start = region->guest_phys_addr;
+	end = start + region->memory_size;
+	if (end < start || end > (1ULL << 48)) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&vm->mmu_lock);
+
+	slot = &vm->memslots[region->slot];
+
+	if (!region->memory_size) {
+		if (slot->npages) {
+			peach_delete_memslot(vm, slot);
+		}
+
+		goto out;
+	}
+
+	if (slot->npages) {
+		ret = -EEXIST;
+
+		goto out;
+	}
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		other = &vm->memslots[i];
+		if (!other->npages) {
+			continue;
+		}
+
+		if (start < (other->base_gfn + other->npages) << PAGE_SHIFT &&
+				end > other->base_gfn << PAGE_SHIFT) {
+			ret = -EEXIST;
+
+			goto out;
+		}
+	}
+
+	ret = peach_create_memslot(vm, slot, region);
+
+out:
+	mutex_unlock(&vm->mmu_lock);
+
+	return ret;
+}
+
+/*
+ * A new slot starts out empty: nothing is pinned and nothing is mapped
+ * until the guest touches it, see peach_memslot_fault().
+ */
+static int peach_create_memslot(struct peach_vm *vm,
+			struct peach_memslot *slot,
+			struct peach_memory_region *region)
+{
+	unsigned long npages;
+
+	struct page **pages;
+
+	npages = region->memory_size >> PAGE_SHIFT;
+
+	pages = kvcalloc(npages, sizeof(*pages), GFP_KERNEL_ACCOUNT);
+	if (!pages) {
+		return -ENOMEM;
+	}
+
+	if (region->flags & PEACH_MEM_LOG_DIRTY_PAGES) {
+		slot->dirty_bitmap = kvcalloc(BITS_TO_LONGS(npages),
+				sizeof(long), GFP_KERNEL_ACCOUNT);
+		if (!slot->dirty_bitmap) {
+			kvfree(pages);
+
+			return -ENOMEM;
+		}
+	}
+
+	slot->base_gfn = region->guest_phys_addr >> PAGE_SHIFT;
+	slot->npages = npages;
+	slot->userspace_addr = region->userspace_addr;
+	slot->flags = region->flags;
+	slot->pages = pages;
+
+	return 0;
+}
+
+static struct peach_memslot *peach_gfn_to_memslot(struct peach_vm *vm,
+			u64 gfn)
+{
+	int i;
+
+	struct peach_memslot *slot;
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		slot = &vm->memslots[i];
+
+		if (gfn >= slot->base_gfn && gfn - slot->base_gfn < slot->npages) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Pins the pages [i, i + n) of the slot that are not pinned yet. Pages
+ * of the VMM that are not populated are faulted in here, so this may
+ * sleep. Returns the number of pages from i on that are pinned now.
+ */
+static unsigned long peach_memslot_pin(struct peach_memslot *slot,
+			unsigned long i, unsigned long n)
+{
+	int ret;
+
+	unsigned int gup_flags;
+
+	unsigned long j;
+	unsigned long run;
+
+	gup_flags = FOLL_LONGTERM;
+	if (!(slot->flags & PEACH_MEM_READONLY)) {
+		gup_flags |= FOLL_WRITE;
+	}
+
+	for (j = i; j < i + n; j += ret) {
+		if (slot->pages[j]) {
+			ret = 1;
+
+			continue;
+		}
+
+		for (run = 1; j + run < i + n && !slot->pages[j + run]; run++) {
+			;
+		}
+
+		ret = pin_user_pages_fast(slot->userspace_addr + (j << PAGE_SHIFT),
+				min_t(unsigned long, run, INT_MAX), gup_flags,
+				slot->pages + j);
+		if (ret <= 0) {
+			break;
+		}
+	}
+
+	return j - i;
+}
+
+/*
+ * Populates the EPT for a fault on gfn, which lies in slot and is not
+ * mapped. The block of prefault_pages pages around gfn is pinned and
+ * mapped along with it, physically contiguous runs with large leaves
+ * where possible. Pages in the block that are already mapped are left
+ * alone so that a large leaf covering them is not split. Called with
+ * vm->mmu_lock held.
+ */
+static int peach_memslot_fault(struct peach_vm *vm,
+			struct peach_memslot *slot,
+			u64 gfn)
+{
+	int ret = 0;
+	int level;
+	int flush = 0;
+
+	unsigned long i;
+	unsigned long n;
+	unsigned long start;
+	unsigned long end;
+	unsigned long pfn;
+	unsigned long window;
+
+	u64 prot;
+
+	window = max(READ_ONCE(prefault_pages), 1U);
+
+	start = rounddown(gfn - slot->base_gfn, window);
+	end = min(start + window, slot->npages);
+
+	/* the faulting page must be there, the rest is best effort */
+	i = gfn - slot->base_gfn;
+	if (!peach_memslot_pin(slot, i, 1)) {
+		return -EFAULT;
+	}
+
+	peach_memslot_pin(slot, start, i - start);
+	peach_memslot_pin(slot, i + 1, end - i - 1);
+
+	prot = EPT_RWX;
+	if (slot->flags & PEACH_MEM_READONLY) {
+		prot = EPT_READ | EPT_EXEC;
+	}
+
+	/* nothing to log, so keep writes from setting flags or filling the PML */
+	if (!slot->dirty_bitmap) {
+		prot |= EPT_ACCESSED | EPT_DIRTY;
+	}
+
+	for (i = start; i < end; i += n) {
+		if (!slot->pages[i] || ept_lookup(vm,
+				(slot->base_gfn + i) << PAGE_SHIFT, &level)) {
+			n = 1;
+
+			continue;
+		}
+
+		pfn = page_to_pfn(slot->pages[i]);
+
+		/*
+		 * The dirty flag of a large leaf would make all of its pages
+		 * dirty, so logged slots are mapped one page at a time.
+		 */
+		for (n = 1; i + n < end && !slot->dirty_bitmap; n++) {
+			if (!slot->pages[i + n] ||
+					page_to_pfn(slot->pages[i + n]) != pfn + n ||
+					ept_lookup(vm, (slot->base_gfn + i + n)
+						<< PAGE_SHIFT, &level)) {
+				break;
+			}
+		}
+
+		ret = ept_map_range(vm, (slot->base_gfn + i) << PAGE_SHIFT,
+				(u64) pfn << PAGE_SHIFT, (u64) n << PAGE_SHIFT,
+				prot, &flush);
+		if (ret) {
+			break;
+		}
+	}
+
+	/* only set when mapping replaced something the guest could see */
+	if (flush) {
+		peach_vm_flush_ept(vm);
+	}
+
+	return ret;
+}
+
+static void peach_delete_memslot(struct peach_vm *vm,
+			struct peach_memslot *slot)
+{
+	int flush = 0;
+
+	unsigned long i;
+	unsigned long n;
+
+	/*
+	 * Leaves never straddle a slot boundary, so unmapping a whole slot
+	 * never has to split one and cannot fail.
+	 */
+	ept_unmap_range(vm, slot->base_gfn << PAGE_SHIFT,
+			(u64) slot->npages << PAGE_SHIFT, &flush);
+
+	/* no vCPU may reach the pages through a stale translation now */
+	if (flush) {
+		peach_vm_flush_ept(vm);
+	}
+
+	/* only the pages the guest touched were ever pinned */
+	for (i = 0; i < slot->npages; i += n) {
+		for (n = 0; i + n < slot->npages && slot->pages[i + n]; n++) {
+			;
+		}
+
+		if (!n) {
+			n = 1;
+
+			continue;
+		}
+
+		unpin_user_pages_dirty_lock(slot->pages + i, n,
+				!(slot->flags & PEACH_MEM_READONLY));
+	}
+
+	peach_memslot_free_snapshot(slot);
+
+	kvfree(slot->pages);
+	kvfree(slot->dirty_bitmap);
+
+	memset(slot, 0, sizeof(*slot));
+
+	return;
+}
+
+/*
+ * Collects the EPT dirty flags of the slot into its bitmap, then hands
+ * the bitmap to userspace and starts over. A flag is cleared before the
+ * flush that drops cached translations, so a write that lands in
+ * between still finds the page reported in this round, and userspace
+ * copies the page only after the ioctl returns.
+ *
+ * With the page-modification log the bitmap is filled as vCPUs drain
+ * their logs, and only the flags of the pages reported are cleared, so
+ * the cost follows the pages written instead of the pages mapped. Logs
+ * of vCPUs in the guest are drained after their next exit and show up
+ * in the next call; a vCPU that returned from PEACH_RUN has none left.
+ */
+static long peach_vm_get_dirty_log(struct peach_vm *vm,
+			struct peach_dirty_log *log)
+{
+	long ret = 0;
+
+	unsigned long size;
+
+	struct peach_memslot *slot;
+
+	if (log->slot >= PEACH_MAX_MEMORY_SLOTS) {
+		return -EINVAL;
+	}
+
+	/* draining takes mmu_lock in the vCPU threads */
+	if (enable_pml && peach_vm_drain_pml(vm)) {
+		return -EINTR;
+	}
+
+	mutex_lock(&vm->mmu_lock);
+
+	slot = &vm->memslots[log->slot];
+	if (!slot->dirty_bitmap) {
+		ret = -ENOENT;
+
+		goto out;
+	}
+
+	peach_memslot_sync_dirty(vm, slot);
+
+	/* on failure the pages stay dirty for the next call */
+	size = BITS_TO_LONGS(slot->npages) * sizeof(long);
+	if (copy_to_user((void __user *) log->dirty_bitmap,
+				slot->dirty_bitmap, size)) {
+		ret = -EFAULT;
+
+		goto out;
+	}
+
+	memset(slot->dirty_bitmap, 0, size);
+
+out:
+	mutex_unlock(&vm->mmu_lock);
+
+	return ret;
+}
+
+/*
+ * Has every vCPU in PEACH_RUN drain its page-modification log into the
+ * dirty bitmaps and waits until they all have. Only a vCPU's own thread
+ * can do that, its VMCS being current on no other CPU, so vCPUs in the
+ * guest are kicked out and halted ones woken up; a halted vCPU executes
+ * its HLT again afterwards. vCPUs outside PEACH_RUN drained their logs
+ * when they left it. Returns 0, or -EINTR if a signal came first.
+ */
+static int peach_vm_drain_pml(struct peach_vm *vm)
+{
+	int i;
+
+	struct peach_vcpu *vcpu;
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (vcpu) {
+			WRITE_ONCE(vcpu->pml_drain, 1);
+		}
+	}
+
+	/* pairs with the barrier between setting IN_GUEST_MODE and the check */
+	smp_mb();
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (vcpu) {
+			peach_vcpu_wake(vcpu);
+		}
+	}
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (vcpu && wait_event_interruptible(vm->pml_wq,
+					!READ_ONCE(vcpu->pml_drain) ||
+					!smp_load_acquire(&vcpu->in_run))) {
+			return -EINTR;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Brings the bitmap of a logged slot up to date, see
+ * peach_vm_get_dirty_log(), and adds what it holds to the pages written
+ * since the snapshot. With PML, the vCPUs' logs must have been drained
+ * already. Called with vm->mmu_lock held.
+ */
+static void peach_memslot_sync_dirty(struct peach_vm *vm,
+			struct peach_memslot *slot)
+{
+	int flush = 0;
+
+	u64 start;
+	u64 end;
+
+	start = slot->base_gfn << PAGE_SHIFT;
+	end = start + ((u64) slot->npages << PAGE_SHIFT);
+
+	if (enable_pml) {
+		ept_clean_dirty(vm, slot, &flush);
+	} else {
+		ept_harvest_dirty(vm->ept_root, EPT_LEVELS, start, end, start,
+				slot->dirty_bitmap, &flush);
+	}
+
+	if (flush) {
+		peach_vm_flush_ept(vm);
+	}
+
+	if (slot->snap_dirty) {
+		bitmap_or(slot->snap_dirty, slot->snap_dirty,
+				slot->dirty_bitmap, slot->npages);
+	}
+
+	return;
+}
+
+/*
+ * Takes the locks of all vCPUs, which keeps them out of the guest and
+ * their state still. A vCPU in PEACH_RUN holds its lock for as long as
+ * it runs, so that is reported instead of waited for. Called with
+ * vm->lock held, which keeps new vCPUs from showing up.
+ */
+static int peach_vm_lock_vcpus(struct peach_vm *vm)
+{
+	int i;
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		if (vm->vcpus[i] && !mutex_trylock(&vm->vcpus[i]->lock)) {
+			peach_vm_unlock_vcpus(vm, i);
+
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+/* Releases the locks of the first n vCPUs. */
+static void peach_vm_unlock_vcpus(struct peach_vm *vm, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (vm->vcpus[i]) {
+			mutex_unlock(&vm->vcpus[i]->lock);
+		}
+	}
+
+	return;
+}
+
+static long peach_vm_snapshot(struct peach_vm *vm)
+{
+	long ret;
+	int i;
+
+	mutex_lock(&vm->lock);
+
+	ret = peach_vm_lock_vcpus(vm);
+	if (ret) {
+		goto out;
+	}
+
+	/* the previous snapshot is overwritten in place */
+	vm->snapshot_valid = 0;
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		if (vm->vcpus[i]) {
+			ret = peach_vcpu_snapshot(vm->vcpus[i]);
+			if (ret) {
+				goto unlock;
+			}
+		}
+	}
+
+	mutex_lock(&vm->mmu_lock);
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		if (!vm->memslots[i].npages) {
+			continue;
+		}
+
+		if (vm->memslots[i].dirty_bitmap) {
+			peach_memslot_sync_dirty(vm, &vm->memslots[i]);
+		}
+
+		ret = peach_memslot_snapshot(&vm->memslots[i]);
+		if (ret) {
+			break;
+		}
+	}
+
+	mutex_unlock(&vm->mmu_lock);
+
+unlock:
+	/* what was saved already would be restored half old, half new */
+	if (ret) {
+		peach_vm_free_snapshot(vm);
+	} else {
+		vm->snapshot_valid = 1;
+	}
+
+	peach_vm_unlock_vcpus(vm, PEACH_MAX_VCPUS);
+
+out:
+	mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+/*
+ * Drops every piece of the snapshot. Called with vm->lock and the locks of
+ * all vCPUs held.
+ */
+static void peach_vm_free_snapshot(struct peach_vm *vm)
+{
+	int i;
+
+	mutex_lock(&vm->mmu_lock);
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		peach_memslot_free_snapshot(&vm->memslots[i]);
+	}
+
+	mutex_unlock(&vm->mmu_lock);
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		if (vm->vcpus[i]) {
+			kvfree(vm->vcpus[i]->snapshot);
+			vm->vcpus[i]->snapshot = NULL;
+		}
+	}
+
+	vm->snapshot_valid = 0;
+
+	return;
+}
+
+static long peach_vm_restore(struct peach_vm *vm)
+{
+	long ret;
+	int i;
+
+	struct peach_memslot *slot;
+
+	mutex_lock(&vm->lock);
+
+	/* there is none, or PEACH_SNAPSHOT failed halfway */
+	if (!vm->snapshot_valid) {
+		ret = -ENOENT;
+
+		goto out;
+	}
+
+	ret = peach_vm_lock_vcpus(vm);
+	if (ret) {
+		goto out;
+	}
+
+	mutex_lock(&vm->mmu_lock);
+
+	for (i = 0; i < PEACH_MAX_MEMORY_SLOTS; i++) {
+		slot = &vm->memslots[i];
+		if (!slot->snap_pages) {
+			continue;
+		}
+
+		if (slot->dirty_bitmap) {
+			peach_memslot_sync_dirty(vm, slot);
+		}
+
+		peach_memslot_restore(slot);
+	}
+
+	mutex_unlock(&vm->mmu_lock);
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		if (vm->vcpus[i] && vm->vcpus[i]->snapshot) {
+			peach_vcpu_restore(vm->vcpus[i]);
+		}
+	}
+
+	peach_vm_unlock_vcpus(vm, PEACH_MAX_VCPUS);
+
+out:
+	mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+/*
+ * Copies the page at i of the slot into *copy, or leaves it NULL if it
+ * holds only zeros. A page the guest touched is read through its pinned
+ * page, any other from the VMM's mapping.
+ */
+static int peach_memslot_copy_page(struct peach_memslot *slot,
+			unsigned long i, struct page **copy)
+{
+	void *src;
+	void *dst;
+
+	if (!*copy) {
+		*copy = alloc_page(GFP_KERNEL_ACCOUNT);
+		if (!*copy) {
+			return -ENOMEM;
+		}
+	}
+
+	dst = kmap_local_page(*copy);
+
+	if (slot->pages[i]) {
+		src = kmap_local_page(slot->pages[i]);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap_local(src);
+	} else if (copy_from_user(dst, (void __user *) (slot->userspace_addr +
+					(i << PAGE_SHIFT)), PAGE_SIZE)) {
+		kunmap_local(dst);
+
+		return -EFAULT;
+	}
+
+	src = memchr_inv(dst, 0, PAGE_SIZE);
+
+	kunmap_local(dst);
+
+	if (!src) {
+		__free_page(*copy);
+		*copy = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Saves the contents of the slot. The first snapshot copies every page,
+ * later ones only those written since the one before, if the slot logs
+ * dirty pages. Called with vm->mmu_lock held and the dirty log synced.
+ */
+static int peach_memslot_snapshot(struct peach_memslot *slot)
+{
+	int ret;
+
+	unsigned long i;
+
+	if (!slot->snap_pages) {
+		slot->snap_pages = kvcalloc(slot->npages,
+				sizeof(*slot->snap_pages), GFP_KERNEL_ACCOUNT);
+		if (!slot->snap_pages) {
+			return -ENOMEM;
+		}
+
+		if (slot->dirty_bitmap) {
+			slot->snap_dirty = kvcalloc(BITS_TO_LONGS(slot->npages),
+					sizeof(long), GFP_KERNEL_ACCOUNT);
+			if (!slot->snap_dirty) {
+				return -ENOMEM;
+			}
+
+			bitmap_set(slot->snap_dirty, 0, slot->npages);
+		}
+	}
+
+	for (i = 0; i < slot->npages; i++) {
+		if (slot->snap_dirty && !test_bit(i, slot->snap_dirty)) {
+			continue;
+		}
+
+		ret = peach_memslot_copy_page(slot, i, &slot->snap_pages[i]);
+		if (ret) {
+			return ret;
+		}
+
+		cond_resched();
+	}
+
+	if (slot->snap_dirty) {
+		bitmap_zero(slot->snap_dirty, slot->npages);
+	}
+
+	return 0;
+}
+
+/*
+ * Puts back the pages written since the snapshot. Only pinned pages can
+ * have been written by the guest, so without a log those are the ones
+ * rewritten. The pages become dirty for PEACH_GET_DIRTY_LOG as a guest
+ * write would make them. Called with vm->mmu_lock held and the dirty
+ * log synced.
+ */
+static void peach_memslot_restore(struct peach_memslot *slot)
+{
+	unsigned long i;
+
+	void *src;
+	void *dst;
+
+	for (i = 0; i < slot->npages; i++) {
+		if (slot->snap_dirty && !test_bit(i, slot->snap_dirty)) {
+			continue;
+		}
+
+		if (!slot->pages[i]) {
+			continue;
+		}
+
+		dst = kmap_local_page(slot->pages[i]);
+
+		if (slot->snap_pages[i]) {
+			src = kmap_local_page(slot->snap_pages[i]);
+			memcpy(dst, src, PAGE_SIZE);
+			kunmap_local(src);
+		} else {
+			memset(dst, 0, PAGE_SIZE);
+		}
+
+		kunmap_local(dst);
+	}
+
+	if (slot->snap_dirty) {
+		bitmap_or(slot->dirty_bitmap, slot->dirty_bitmap,
+				slot->snap_dirty, slot->npages);
+		bitmap_zero(slot->snap_dirty, slot->npages);
+	}
+
+	return;
+}
+
+static void peach_memslot_free_snapshot(struct peach_memslot *slot)
+{
+	unsigned long i;
+
+	if (slot->snap_pages) {
+		for (i = 0; i < slot->npages; i++) {
+			if (slot->snap_pages[i]) {
+				__free_page(slot->snap_pages[i]);
+			}
+		}
+	}
+
+	kvfree(slot->snap_pages);
+	kvfree(slot->snap_dirty);
+
+	slot->snap_pages = NULL;
+	slot->snap_dirty = NULL;
+
+	return;
+}
+
+static long peach_vm_register_coalesced(struct peach_vm *vm,
+			struct peach_coalesced_zone *zone)
+{
+	long ret = 0;
+
+	if (!zone->size || zone->pio > 1 ||
+			zone->addr + zone->size < zone->addr ||
+			(zone->pio && zone->addr + zone->size > 0x10000)) {
+		return -EINVAL;
+	}
+
+	spin_lock(&vm->coalesced_lock);
+
+	if (vm->nr_coalesced_zones == PEACH_MAX_COALESCED_ZONES) {
+		ret = -ENOSPC;
+	} else {
+		vm->coalesced_zones[vm->nr_coalesced_zones++] = *zone;
+	}
+
+	spin_unlock(&vm->coalesced_lock);
+
+	return ret;
+}
+
+/* Removes every zone that lies within the one given, as KVM does. */
+static long peach_vm_unregister_coalesced(struct peach_vm *vm,
+			struct peach_coalesced_zone *zone)
+{
+	int i;
+
+	struct peach_coalesced_zone *z;
+
+	spin_lock(&vm->coalesced_lock);
+
+	for (i = 0; i < vm->nr_coalesced_zones; ) {
+		z = &vm->coalesced_zones[i];
+
+		if (z->pio == zone->pio && z->addr >= zone->addr &&
+				z->addr + z->size <= zone->addr + zone->size) {
+			*z = vm->coalesced_zones[--vm->nr_coalesced_zones];
+		} else {
+			i++;
+		}
+	}
+
+	spin_unlock(&vm->coalesced_lock);
+
+	return 0;
+}
+
+/*
+ * Appends a write of len bytes of data to addr to the coalesced ring.
+ * Returns 1 if it was, 0 if no zone covers it or the ring is full and
+ * the write has to exit to userspace instead.
+ */
+static int peach_coalesced_append(struct peach_vm *vm, u64 addr, u32 len,
+			u32 pio, u64 data)
+{
+	int i;
+	int ret = 0;
+
+	u32 last;
+
+	struct peach_coalesced_zone *z;
+	struct peach_coalesced_ring *ring;
+	struct peach_coalesced_entry *entry;
+
+	ring = vm->coalesced_ring;
+
+	spin_lock(&vm->coalesced_lock);
+
+	for (i = 0; i < vm->nr_coalesced_zones; i++) {
+		z = &vm->coalesced_zones[i];
+
+		if (z->pio == pio && addr >= z->addr &&
+				addr + len <= z->addr + z->size) {
+			break;
+		}
+	}
+
+	if (i == vm->nr_coalesced_zones) {
+		goto out;
+	}
+
+	/* the ring is shared with userspace, which may have scribbled on it */
+	last = READ_ONCE(ring->last);
+	if (last >= PEACH_COALESCED_MAX ||
+			(last + 1) % PEACH_COALESCED_MAX == READ_ONCE(ring->first)) {
+		goto out;
+	}
+
+	entry = &ring->entries[last];
+	entry->addr = addr;
+	entry->len = len;
+	entry->pio = pio;
+	memcpy(entry->data, &data, sizeof(entry->data));
+
+	/* the entry is complete before the VMM can see it */
+	smp_wmb();
+	WRITE_ONCE(ring->last, (last + 1) % PEACH_COALESCED_MAX);
+
+	ret = 1;
+
+out:
+	spin_unlock(&vm->coalesced_lock);
+
+	return ret;
+}
+
+/* The bit of msr in the read half of the MSR bitmap, or -1 if it has none. */
+static int msr_bitmap_bit(u32 msr)
+{
+	if (msr < MSR_BITMAP_LOW_END) {
+		return msr;
+	}
+
+	if (msr - MSR_BITMAP_HIGH_BASE < MSR_BITMAP_LOW_END) {
+		return MSR_BITMAP_HIGH_OFFSET + (msr - MSR_BITMAP_HIGH_BASE);
+	}
+
+	return -1;
+}
+
+/*
+ * Whether the guest's value of msr is loaded before it runs and saved
+ * with the host's restored afterwards, which makes it safe to let guest
+ * writes through.
+ */
+static int msr_switched(u32 msr)
+{
+	switch (msr) {
+	case MSR_IA32_SYSENTER_CS:
+	case MSR_IA32_SYSENTER_ESP:
+	case MSR_IA32_SYSENTER_EIP:
+	case MSR_FS_BASE:
+	case MSR_GS_BASE:
+		return 1;
+
+	/* read back by peach_vcpu_put_msrs() */
+	case MSR_KERNEL_GS_BASE:
+		return 1;
+
+	case MSR_EFER:
+		return vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER &&
+			vmcs_config.vmexit & VM_EXIT_SAVE_IA32_EFER;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The bitmap is changed while vCPUs may be running with it. An access
+ * checks the bitmap each time it executes, so a change applies from the
+ * next access on; no vCPU has to be kicked.
+ */
+static long peach_vm_set_msr_range(struct peach_vm *vm,
+			struct peach_msr_range *range)
+{
+	u32 i;
+	int bit;
+
+	if (!vm->msr_bitmap) {
+		return -EOPNOTSUPP;
+	}
+
+	if (range->flags & ~(PEACH_MSR_ALLOW_READ | PEACH_MSR_ALLOW_WRITE)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < range->nmsrs; i++) {
+		if (msr_bitmap_bit(range->base + i) < 0) {
+			return -EINVAL;
+		}
+
+		if (range->flags & PEACH_MSR_ALLOW_WRITE &&
+				!msr_switched(range->base + i)) {
+			return -EPERM;
+		}
+	}
+
+	for (i = 0; i < range->nmsrs; i++) {
+		bit = msr_bitmap_bit(range->base + i);
+
+		if (range->flags & PEACH_MSR_ALLOW_READ) {
+			clear_bit(bit, vm->msr_bitmap);
+		} else {
+			set_bit(bit, vm->msr_bitmap);
+		}
+
+		if (range->flags & PEACH_MSR_ALLOW_WRITE) {
+			clear_bit(MSR_BITMAP_WRITE_OFFSET + bit, vm->msr_bitmap);
+		} else {
+			set_bit(MSR_BITMAP_WRITE_OFFSET + bit, vm->msr_bitmap);
+		}
+	}
+
+	return 0;
+}
+
+/* Takes effect right away, like peach_vm_set_msr_range(). */
+static long peach_vm_set_io_range(struct peach_vm *vm,
+			struct peach_io_range *range)
+{
+	if (!vm->io_bitmap) {
+		return -EOPNOTSUPP;
+	}
+
+	if (range->base + range->nports < range->base ||
+			range->base + range->nports > 0x10000) {
+		return -EINVAL;
+	}
+
+	/* bitmap_set() and bitmap_clear() are not atomic */
+	mutex_lock(&vm->lock);
+
+	if (range->allow) {
+		bitmap_clear(vm->io_bitmap, range->base, range->nports);
+	} else {
+		bitmap_set(vm->io_bitmap, range->base, range->nports);
+	}
+
+	mutex_unlock(&vm->lock);
+
+	return 0;
+}
+
+/*
+ * Copies up to len bytes of guest-physical memory at gpa to data, up to
+ * the first page no slot backs, and returns the number of bytes copied.
+ * Called with vm->mmu_lock held.
+ */
+static unsigned long peach_read_guest(struct peach_vm *vm, u64 gpa,
+			void *data, unsigned long len)
+{
+	unsigned long i;
+	unsigned long n;
+	unsigned long done;
+
+	void *va;
+
+	struct peach_memslot *slot;
+
+	for (done = 0; done < len; done += n, gpa += n) {
+		slot = peach_gfn_to_memslot(vm, gpa >> PAGE_SHIFT);
+		if (!slot) {
+			break;
+		}
+
+		i = (gpa >> PAGE_SHIFT) - slot->base_gfn;
+		if (!peach_memslot_pin(slot, i, 1)) {
+			break;
+		}
+
+		n = min(len - done, PAGE_SIZE - offset_in_page(gpa));
+
+		va = kmap_local_page(slot->pages[i]);
+		memcpy(data + done, va + offset_in_page(gpa), n);
+		kunmap_local(va);
+	}
+
+	return done;
+}
+
+/*
+ * peach_read_guest() for guest-linear memory at gva, translated page by
+ * page with the guest's page tables as paging describes them.
+ */
+static unsigned long peach_read_guest_virt(struct peach_vm *vm,
+			struct guest_paging *paging, u64 gva, void *data,
+			unsigned long len)
+{
+	unsigned long n;
+	unsigned long done;
+	unsigned long copied;
+
+	u64 gpa;
+
+	for (done = 0; done < len; done += n, gva += n) {
+		if (guest_translate(vm, paging, gva, &gpa)) {
+			break;
+		}
+
+		n = min(len - done, PAGE_SIZE - offset_in_page(gva));
+
+		copied = peach_read_guest(vm, gpa, data + done, n);
+		if (copied < n) {
+			return done + copied;
+		}
+	}
+
+	return done;
+}
+
+static void peach_kick_ack(void *info)
+{
+	return;
+}
+
+/*
+ * Called with vm->mmu_lock held after present EPT entries were changed. Every
+ * vCPU flushes its EPT translations before its next VM entry, and vCPUs
+ * that are in the guest right now are kicked out with an IPI, which this
+ * waits for, so stale translations are gone by the time it returns.
+ */
+static void peach_vm_flush_ept(struct peach_vm *vm)
+{
+	int i;
+
+	struct peach_vcpu *vcpu;
+
+	/*
+	 * vCPUs that are not loaded flush when they are loaded on a marked
+	 * CPU, the others when they see the new generation. A vCPU that
+	 * reads the new generation on load also sees the marks.
+	 */
+	cpumask_or(&vm->ept_stale, &vm->ept_stale, &vm->ran_on);
+	smp_wmb();
+
+	WRITE_ONCE(vm->ept_gen, vm->ept_gen + 1);
+
+	/* pairs with the barrier between setting IN_GUEST_MODE and the check */
+	smp_mb();
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		/* a vCPU created after this point flushes on its first load */
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (!vcpu) {
+			continue;
+		}
+
+		peach_vcpu_kick(vcpu);
+	}
+
+	/*
+	 * A vCPU that was loaded on a new CPU while the marks were set may
+	 * have run there since, the kicks made that CPU visible.
+	 */
+	smp_mb();
+	cpumask_or(&vm->ept_stale, &vm->ept_stale, &vm->ran_on);
+
+	/* every vCPU flushes before it walks the EPT again */
+	ept_free_deferred(vm);
+
+	return;
+}
+
+/*
+ * Ends every PEACH_RUN of the VM with PEACH_EXIT_SHUTDOWN, now and from
+ * then on. vCPUs in the guest are kicked out, halted ones woken up.
+ */
+static void peach_vm_shutdown(struct peach_vm *vm)
+{
+	int i;
+
+	struct peach_vcpu *vcpu;
+
+	WRITE_ONCE(vm->shutdown, 1);
+
+	/* pairs with the barrier between setting IN_GUEST_MODE and the check */
+	smp_mb();
+
+	for (i = 0; i < PEACH_MAX_VCPUS; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (vcpu) {
+			peach_vcpu_wake(vcpu);
+		}
+	}
+
+	return;
+}
+
+/*
+ * Forces the vCPU out of the guest if it is in there right now and waits
+ * for the IPI to arrive. Callers make the reason visible before a full
+ * barrier, so a vCPU that is just entering sees it instead.
+ */
+static void peach_vcpu_kick(struct peach_vcpu *vcpu)
+{
+	int cpu;
+
+	cpu = READ_ONCE(vcpu->cpu);
+	if (cpu >= 0 && READ_ONCE(vcpu->mode) == IN_GUEST_MODE) {
+		smp_call_function_single(cpu, peach_kick_ack, NULL, 1);
+	}
+
+	return;
+}
+
+/* Makes the vCPU notice an event it was given, whether halted or not. */
+static void peach_vcpu_wake(struct peach_vcpu *vcpu)
+{
+	wake_up_interruptible(&vcpu->wq);
+	peach_vcpu_kick(vcpu);
+
+	return;
+}
+
+/* Whether a halted vCPU has something to do. */
+static int peach_vcpu_has_events(struct peach_vcpu *vcpu)
+{
+	if (READ_ONCE(vcpu->vm->shutdown)) {
+		return 1;
+	}
+
+	return vcpu->halt_irqs_on && !bitmap_empty(vcpu->pending_irqs, 256);
+}
+
+/*
+ * Waits until the vCPU has an event, polling for halt_poll_ns of the
+ * vCPU before it goes to sleep. The window adapts to how long halts
+ * last: it grows while events come in soon enough for a poll of at most
+ * the halt_poll_ns parameter to catch them, and is dropped once one
+ * comes later than that, so a vCPU that idles for long stretches does
+ * not burn a host CPU. Returns 1 once there is an event, 0 if a signal
+ * or a request to drain the page-modification log came first. Must not
+ * be called with the vCPU loaded.
+ */
+static int peach_vcpu_halt(struct peach_vcpu *vcpu)
+{
+	u64 start;
+	u64 block_ns;
+
+	unsigned int limit;
+
+	limit = READ_ONCE(halt_poll_ns);
+	start = ktime_get_ns();
+
+	if (vcpu->halt_poll_ns) {
+		do {
+			if (peach_vcpu_has_events(vcpu)) {
+				return 1;
+			}
+
+			cpu_relax();
+		} while (ktime_get_ns() - start < min(vcpu->halt_poll_ns, limit) &&
+				!need_resched() && !signal_pending(current) &&
+				!READ_ONCE(vcpu->pml_drain));
+	}
+
+	if (wait_event_interruptible(vcpu->wq, peach_vcpu_has_events(vcpu) ||
+				READ_ONCE(vcpu->pml_drain))) {
+		return 0;
+	}
+
+	/* woken to drain the page-modification log, see peach_vm_drain_pml() */
+	if (!peach_vcpu_has_events(vcpu)) {
+		return 0;
+	}
+
+	block_ns = ktime_get_ns() - start;
+
+	if (block_ns > limit) {
+		vcpu->halt_poll_ns = 0;
+	} else if (vcpu->halt_poll_ns < limit) {
+		vcpu->halt_poll_ns = min(max(vcpu->halt_poll_ns * 2,
+					(unsigned int) HALT_POLL_START_NS), limit);
+	}
+
+	return 1;
+}
+
+static struct peach_vcpu *peach_create_vcpu(struct peach_vm *vm, int id)
+{
+	struct peach_vcpu *vcpu;
+
+	/*
+	 * Everything the vCPU touches on each exit comes from the node of
+	 * the calling thread, so a VMM that pins its vCPU threads should
+	 * create every vCPU from the thread that will run it.
+	 */
+	vcpu = (struct peach_vcpu *) kzalloc(sizeof(*vcpu), GFP_KERNEL);
+	if (!vcpu) {
+		goto err0;
+	}
+
+	vcpu->vm = vm;
+	vcpu->id = id;
+	vcpu->cpu = -1;
+	mutex_init(&vcpu->lock);
+	init_waitqueue_head(&vcpu->wq);
+
+	vcpu->vmcs = (struct vmcs *) kzalloc(4096, GFP_KERNEL);
+	if (!vcpu->vmcs) {
+		goto err1;
+	}
+
+	vcpu->stats = kvzalloc(sizeof(*vcpu->stats), GFP_KERNEL_ACCOUNT);
+	if (!vcpu->stats) {
+		goto err1;
+	}
+
+	/* a power of two is aligned to its size, XSAVE wants 64 bytes */
+	vcpu->guest_fpu = kzalloc(roundup_pow_of_two(guest_fpu_size),
+			GFP_KERNEL_ACCOUNT);
+	if (!vcpu->guest_fpu) {
+		goto err1;
+	}
+
+	/*
+	 * An XSAVE header of zeros puts every component in its initial
+	 * state on the first restore, except MXCSR, which is always loaded.
+	 */
+	*(u32 *) (vcpu->guest_fpu + 24) = 0x1F80;
+
+	vcpu->vmcs->hdr.revision_id = vmcs_config.revision_id;
+	vcpu->vmcs->hdr.shadow = 0x00000000;
+
+	/* puts the new VMCS in the clear launch state, any CPU will do */
+	get_cpu();
+	vmcs_clear(__pa(vcpu->vmcs));
+	put_cpu();
+
+	/*
+	 * vCPUs of one VM share the EPT root, so only a VPID of their own
+	 * keeps their guest-linear translations apart. Once all are taken
+	 * the vCPU runs without one, and every VM entry and exit flushes
+	 * its translations instead.
+	 */
+	if (vmcs_config.cpu_based_2nd & SECONDARY_EXEC_ENABLE_VPID) {
+		vcpu->vpid = ida_alloc_range(&peach_vpid_ida, 1, 0xFFFF,
+				GFP_KERNEL);
+		if (vcpu->vpid < 0) {
+			vcpu->vpid = 0;
+		}
+	}
+
+	if (enable_pml) {
+		vcpu->pml_buffer = (u64 *) get_zeroed_page(GFP_KERNEL_ACCOUNT);
+		if (!vcpu->pml_buffer) {
+			goto err1;
+		}
+	}
+
+	return vcpu;
+
+err1:
+	peach_destroy_vcpu(vcpu);
+
+err0:
+
+	return NULL;
+}
+
+static void peach_destroy_vcpu(struct peach_vcpu *vcpu)
+{
+	/* the CPU it is active on could write it back to freed memory */
+	peach_vcpu_clear(vcpu);
+
+	if (vcpu->vpid > 0) {
+		ida_free(&peach_vpid_ida, vcpu->vpid);
+	}
+
+	if (vcpu->pml_buffer) {
+		free_page((unsigned long) vcpu->pml_buffer);
+	}
+
+	kvfree(vcpu->snapshot);
+	kvfree(vcpu->cpuid_entries);
+	kfree(vcpu->guest_fpu);
+	kvfree(vcpu->stats);
+	kfree(vcpu->vmcs);
+	kfree(vcpu);
+
+	return;
+}
+
+static int cpuid_entry_cmp(const void *a, const void *b)
+{
+	const struct peach_cpuid_entry *x = a;
+	const struct peach_cpuid_entry *y = b;
+
+	if (x->function != y->function) {
+		return x->function < y->function ? -1 : 1;
+	}
+
+	if (x->index != y->index) {
+		return x->index < y->index ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Replaces the vCPU's CPUID table. Entries whose index does not matter
+ * are stored with index 0, so one sorted array answers both kinds of
+ * lookup, see peach_vcpu_find_cpuid().
+ */
+static long peach_vcpu_set_cpuid(struct peach_vcpu *vcpu,
+			struct peach_cpuid *cpuid)
+{
+	int i;
+
+	struct peach_cpuid_entry *entries = NULL;
+
+	if (cpuid->nent > PEACH_MAX_CPUID_ENTRIES) {
+		return -E2BIG;
+	}
+
+	if (cpuid->flags & ~PEACH_CPUID_HOST_PASSTHROUGH) {
+		return -EINVAL;
+	}
+
+	if (cpuid->nent) {
+		entries = kvmalloc_array(cpuid->nent, sizeof(*entries),
+				GFP_KERNEL_ACCOUNT);
+		if (!entries) {
+			return -ENOMEM;
+		}
+
+		if (copy_from_user(entries, (void __user *) cpuid->entries,
+					cpuid->nent * sizeof(*entries))) {
+			kvfree(entries);
+
+			return -EFAULT;
+		}
+	}
+
+	for (i = 0; i < cpuid->nent; i++) {
+		if (entries[i].flags & ~PEACH_CPUID_FLAG_SIGNIFICANT_INDEX) {
+			kvfree(entries);
+
+			return -EINVAL;
+		}
+
+		if (!(entries[i].flags & PEACH_CPUID_FLAG_SIGNIFICANT_INDEX)) {
+			entries[i].index = 0;
+		}
+	}
+
+	sort(entries, cpuid->nent, sizeof(*entries), cpuid_entry_cmp, NULL);
+
+	/* otherwise which of them answers would depend on the sort */
+	for (i = 1; i < cpuid->nent; i++) {
+		if (!cpuid_entry_cmp(&entries[i - 1], &entries[i])) {
+			kvfree(entries);
+
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&vcpu->lock);
+
+	swap(vcpu->cpuid_entries, entries);
+	vcpu->cpuid_nent = cpuid->nent;
+	vcpu->cpuid_flags = cpuid->flags;
+
+	mutex_unlock(&vcpu->lock);
+
+	kvfree(entries);
+
+	return 0;
+}
+
+static struct peach_cpuid_entry *peach_vcpu_find_cpuid(
+			struct peach_vcpu *vcpu, u32 function, u32 index)
+{
+	struct peach_cpuid_entry key;
+	struct peach_cpuid_entry *entry;
+
+	key.function = function;
+	key.index = index;
+
+	entry = bsearch(&key, vcpu->cpuid_entries, vcpu->cpuid_nent,
+			sizeof(key), cpuid_entry_cmp);
+	if (entry) {
+		return entry;
+	}
+
+	/* a leaf without subleaves answers every index */
+	key.index = 0;
+
+	entry = bsearch(&key, vcpu->cpuid_entries, vcpu->cpuid_nent,
+			sizeof(key), cpuid_entry_cmp);
+	if (entry && !(entry->flags & PEACH_CPUID_FLAG_SIGNIFICANT_INDEX)) {
+		return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * RSP, RIP and RFLAGS live in the VMCS, which is set up here if the vCPU
+ * has not run yet so that what is read or written is what it starts with.
+ */
+static void peach_vcpu_get_regs(struct peach_vcpu *vcpu,
+			struct peach_regs *regs)
+{
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	regs->rax = vcpu->regs.rax;
+	regs->rbx = vcpu->regs.rbx;
+	regs->rcx = vcpu->regs.rcx;
+	regs->rdx = vcpu->regs.rdx;
+	regs->rsi = vcpu->regs.rsi;
+	regs->rdi = vcpu->regs.rdi;
+	regs->rsp = vmcs_read(GUEST_RSP);
+	regs->rbp = vcpu->regs.rbp;
+	regs->r8 = vcpu->regs.r8;
+	regs->r9 = vcpu->regs.r9;
+	regs->r10 = vcpu->regs.r10;
+	regs->r11 = vcpu->regs.r11;
+	regs->r12 = vcpu->regs.r12;
+	regs->r13 = vcpu->regs.r13;
+	regs->r14 = vcpu->regs.r14;
+	regs->r15 = vcpu->regs.r15;
+	regs->rip = vmcs_read(GUEST_RIP);
+	regs->rflags = vmcs_read(GUEST_RFLAGS);
+
+	peach_vcpu_put(vcpu);
+
+	return;
+}
+
+static void peach_vcpu_set_regs(struct peach_vcpu *vcpu,
+			struct peach_regs *regs)
+{
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	vcpu->regs.rax = regs->rax;
+	vcpu->regs.rbx = regs->rbx;
+	vcpu->regs.rcx = regs->rcx;
+	vcpu->regs.rdx = regs->rdx;
+	vcpu->regs.rsi = regs->rsi;
+	vcpu->regs.rdi = regs->rdi;
+	vmcs_write(GUEST_RSP, regs->rsp);
+	vcpu->regs.rbp = regs->rbp;
+	vcpu->regs.r8 = regs->r8;
+	vcpu->regs.r9 = regs->r9;
+	vcpu->regs.r10 = regs->r10;
+	vcpu->regs.r11 = regs->r11;
+	vcpu->regs.r12 = regs->r12;
+	vcpu->regs.r13 = regs->r13;
+	vcpu->regs.r14 = regs->r14;
+	vcpu->regs.r15 = regs->r15;
+	vmcs_write(GUEST_RIP, regs->rip);
+	/* bit 1 is reserved and must be set, VM entry fails otherwise */
+	vmcs_write(GUEST_RFLAGS, regs->rflags | X86_EFLAGS_FIXED);
+
+	/* the result would land in a register the VMM has just written */
+	vcpu->pending_read = 0;
+
+	peach_vcpu_put(vcpu);
+
+	return;
+}
+
+static void get_segment(int seg, struct peach_segment *segment)
+{
+	u32 ar;
+
+	ar = vmcs_read(GUEST_ES_AR_BYTES + seg * 2);
+
+	segment->base = vmcs_read(GUEST_ES_BASE + seg * 2);
+	segment->limit = vmcs_read(GUEST_ES_LIMIT + seg * 2);
+	segment->selector = vmcs_read(GUEST_ES_SELECTOR + seg * 2);
+	segment->type = ar & VMX_AR_TYPE_MASK;
+	segment->present = !(ar & VMX_AR_UNUSABLE) && ar & VMX_AR_P;
+	segment->dpl = (ar & VMX_AR_DPL_MASK) >> VMX_AR_DPL_SHIFT;
+	segment->db = !!(ar & VMX_AR_DB);
+	segment->s = !!(ar & VMX_AR_S);
+	segment->l = !!(ar & VMX_AR_L);
+	segment->g = !!(ar & VMX_AR_G);
+	segment->avl = !!(ar & VMX_AR_AVL);
+	memset(segment->padding, 0, sizeof(segment->padding));
+
+	return;
+}
+
+static void set_segment(int seg, struct peach_segment *segment)
+{
+	u32 ar;
+
+	ar = (segment->type & VMX_AR_TYPE_MASK) |
+		((segment->dpl << VMX_AR_DPL_SHIFT) & VMX_AR_DPL_MASK);
+	ar |= segment->s ? VMX_AR_S : 0;
+	ar |= segment->avl ? VMX_AR_AVL : 0;
+	ar |= segment->l ? VMX_AR_L : 0;
+	ar |= segment->db ? VMX_AR_DB : 0;
+	ar |= segment->g ? VMX_AR_G : 0;
+	ar |= segment->present ? VMX_AR_P : VMX_AR_UNUSABLE;
+
+	vmcs_write(GUEST_ES_BASE + seg * 2, segment->base);
+	vmcs_write(GUEST_ES_LIMIT + seg * 2, segment->limit);
+	vmcs_write(GUEST_ES_SELECTOR + seg * 2, segment->selector);
+	vmcs_write(GUEST_ES_AR_BYTES + seg * 2, ar);
+
+	return;
+}
+
+/*
+ * CR0 as the guest sees it is GUEST_CR0 with TS from the read shadow,
+ * see peach_vcpu_activate_fpu(). CR4.VMXE is left out, VMX needs it set.
+ */
+static void peach_vcpu_get_sregs(struct peach_vcpu *vcpu,
+			struct peach_sregs *sregs)
+{
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	get_segment(SEG_CS, &sregs->cs);
+	get_segment(SEG_DS, &sregs->ds);
+	get_segment(SEG_ES, &sregs->es);
+	get_segment(SEG_FS, &sregs->fs);
+	get_segment(SEG_GS, &sregs->gs);
+	get_segment(SEG_SS, &sregs->ss);
+	get_segment(SEG_TR, &sregs->tr);
+	get_segment(SEG_LDTR, &sregs->ldt);
+
+	memset(&sregs->gdt, 0, sizeof(sregs->gdt));
+	sregs->gdt.base = vmcs_read(GUEST_GDTR_BASE);
+	sregs->gdt.limit = vmcs_read(GUEST_GDTR_LIMIT);
+
+	memset(&sregs->idt, 0, sizeof(sregs->idt));
+	sregs->idt.base = vmcs_read(GUEST_IDTR_BASE);
+	sregs->idt.limit = vmcs_read(GUEST_IDTR_LIMIT);
+
+	sregs->cr0 = (vmcs_read(GUEST_CR0) & ~X86_CR0_TS) |
+		(vmcs_read(CR0_READ_SHADOW) & X86_CR0_TS);
+	sregs->cr3 = vmcs_read(GUEST_CR3);
+	sregs->cr4 = vmcs_read(GUEST_CR4) & ~X86_CR4_VMXE;
+
+	sregs->efer = 0;
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		sregs->efer = vmcs_read(GUEST_IA32_EFER);
+	}
+
+	peach_vcpu_put(vcpu);
+
+	return;
+}
+
+/*
+ * Puts the vCPU in the mode sregs describe. Unrestricted guest lets it
+ * start in any of them, so this is mostly a matter of writing the guest
+ * state; only the IA-32e mode entry control and, with PAE paging outside
+ * long mode, the PDPTEs the CPU loads from the VMCS rather than from
+ * CR3, have to be derived. Returns -EOPNOTSUPP for an EFER the CPU
+ * cannot load on entry and -EINVAL for paging modes entry would refuse.
+ */
+static long peach_vcpu_set_sregs(struct peach_vcpu *vcpu,
+			struct peach_sregs *sregs)
+{
+	int i;
+	int long_mode;
+
+	u64 efer;
+	u64 entry_controls;
+	u64 pdptrs[4];
+
+	memset(pdptrs, 0, sizeof(pdptrs));
+
+	long_mode = sregs->efer & EFER_LME && sregs->cr0 & X86_CR0_PG;
+
+	if (sregs->efer && !(vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER)) {
+		return -EOPNOTSUPP;
+	}
+
+	if (sregs->cr0 & X86_CR0_PG && (!(sregs->cr0 & X86_CR0_PE) ||
+				(long_mode && !(sregs->cr4 & X86_CR4_PAE)))) {
+		return -EINVAL;
+	}
+
+	/* read before the VMCS is loaded, pinning a page may sleep */
+	if (sregs->cr0 & X86_CR0_PG && sregs->cr4 & X86_CR4_PAE && !long_mode) {
+		i = peach_read_pdptrs(vcpu->vm, sregs->cr3, pdptrs);
+		if (i) {
+			return i;
+		}
+	}
+
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	set_segment(SEG_CS, &sregs->cs);
+	set_segment(SEG_DS, &sregs->ds);
+	set_segment(SEG_ES, &sregs->es);
+	set_segment(SEG_FS, &sregs->fs);
+	set_segment(SEG_GS, &sregs->gs);
+	set_segment(SEG_SS, &sregs->ss);
+	set_segment(SEG_TR, &sregs->tr);
+	set_segment(SEG_LDTR, &sregs->ldt);
+
+	vmcs_write(GUEST_GDTR_BASE, sregs->gdt.base);
+	vmcs_write(GUEST_GDTR_LIMIT, sregs->gdt.limit);
+	vmcs_write(GUEST_IDTR_BASE, sregs->idt.base);
+	vmcs_write(GUEST_IDTR_LIMIT, sregs->idt.limit);
+
+	peach_vcpu_write_cr0(vcpu, sregs->cr0);
+	vmcs_write(GUEST_CR3, sregs->cr3);
+	vmcs_write(GUEST_CR4, sregs->cr4 | X86_CR4_VMXE);
+
+	for (i = 0; i < ARRAY_SIZE(pdptrs); i++) {
+		vmcs_write(GUEST_PDPTR0 + i * 2, pdptrs[i]);
+	}
+
+	efer = sregs->efer & ~EFER_LMA;
+	entry_controls = vmcs_read(VM_ENTRY_CONTROLS) & ~VM_ENTRY_IA32E_MODE;
+	if (long_mode) {
+		efer |= EFER_LMA;
+		entry_controls |= VM_ENTRY_IA32E_MODE;
+	}
+
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		vmcs_write(GUEST_IA32_EFER, efer);
+	}
+
+	vmcs_write(VM_ENTRY_CONTROLS, entry_controls);
+
+	/* translations cached under the old page tables carry our VPID */
+	if (vcpu->vpid) {
+		invvpid(vmx_invvpid_type, vcpu->vpid);
+	}
+
+	peach_vcpu_put(vcpu);
+
+	return 0;
+}
+
+/*
+ * Reads the four PDPTEs that PAE paging outside long mode takes from the
+ * table at cr3. Called with the vCPU not loaded, pinning may sleep.
+ */
+static int peach_read_pdptrs(struct peach_vm *vm, u64 cr3, u64 *pdptrs)
+{
+	unsigned long n;
+
+	mutex_lock(&vm->mmu_lock);
+	n = peach_read_guest(vm, cr3 & ~0x1FULL, pdptrs, 4 * sizeof(u64));
+	mutex_unlock(&vm->mmu_lock);
+
+	if (n != 4 * sizeof(u64)) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Called with vcpu->lock held, while the FPU state is not loaded. */
+static int peach_vcpu_snapshot(struct peach_vcpu *vcpu)
+{
+	int i;
+
+	struct peach_vcpu_snapshot *snap;
+
+	snap = vcpu->snapshot;
+	if (!snap) {
+		snap = kvzalloc(struct_size(snap, fpu, guest_fpu_size),
+				GFP_KERNEL_ACCOUNT);
+		if (!snap) {
+			return -ENOMEM;
+		}
+
+		vcpu->snapshot = snap;
+	}
+
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(snapshot_fields); i++) {
+		snap->fields[i] = vmcs_read(snapshot_fields[i]);
+	}
+
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		snap->efer = vmcs_read(GUEST_IA32_EFER);
+	}
+
+	peach_vcpu_put(vcpu);
+
+	snap->regs = vcpu->regs;
+	bitmap_copy(snap->pending_irqs, vcpu->pending_irqs, 256);
+
+	snap->pending_read = vcpu->pending_read;
+	snap->pending_reg = vcpu->pending_reg;
+	snap->pending_shift = vcpu->pending_shift;
+	snap->pending_size = vcpu->pending_size;
+
+	memcpy(snap->syscall_msrs, vcpu->guest_syscall_msrs,
+			sizeof(snap->syscall_msrs));
+	snap->kernel_gs_base = vcpu->guest_kernel_gs_base;
+
+	snap->pkru = vcpu->guest_pkru;
+	memcpy(snap->fpu, vcpu->guest_fpu, guest_fpu_size);
+
+	return 0;
+}
+
+/*
+ * Called with vcpu->lock held. Interrupts queued with PEACH_INJECT_IRQ
+ * since the snapshot are dropped along with everything else.
+ */
+static void peach_vcpu_restore(struct peach_vcpu *vcpu)
+{
+	int i;
+
+	struct peach_vcpu_snapshot *snap = vcpu->snapshot;
+
+	peach_vcpu_load(vcpu);
+
+	for (i = 0; i < ARRAY_SIZE(snapshot_fields); i++) {
+		vmcs_write(snapshot_fields[i], snap->fields[i]);
+	}
+
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		vmcs_write(GUEST_IA32_EFER, snap->efer);
+	}
+
+	/* the page tables may be back to what they were, and CR3 with them */
+	if (vcpu->vpid) {
+		invvpid(vmx_invvpid_type, vcpu->vpid);
+	}
+
+	peach_vcpu_put(vcpu);
+
+	vcpu->regs = snap->regs;
+
+	/*
+	 * PEACH_INJECT_IRQ sets bits without the lock, so they are changed
+	 * one by one. The window is opened on entry if a vector still waits.
+	 */
+	for (i = 0; i < 256; i++) {
+		if (test_bit(i, snap->pending_irqs)) {
+			set_bit(i, vcpu->pending_irqs);
+		} else {
+			clear_bit(i, vcpu->pending_irqs);
+		}
+	}
+
+	vcpu->pending_read = snap->pending_read;
+	vcpu->pending_reg = snap->pending_reg;
+	vcpu->pending_shift = snap->pending_shift;
+	vcpu->pending_size = snap->pending_size;
+
+	memcpy(vcpu->guest_syscall_msrs, snap->syscall_msrs,
+			sizeof(vcpu->guest_syscall_msrs));
+	vcpu->guest_kernel_gs_base = snap->kernel_gs_base;
+
+	vcpu->guest_pkru = snap->pkru;
+	memcpy(vcpu->guest_fpu, snap->fpu, guest_fpu_size);
+
+	return;
+}
+
+/* Runs on the CPU the vCPU's VMCS is active on. */
+static void __peach_vcpu_clear(void *arg)
+{
+	int cpu;
+
+	struct peach_vcpu *vcpu = arg;
+
+	cpu = smp_processor_id();
+
+	/* lost a race with CPU offlining, which cleared it already */
+	if (vcpu->cpu != cpu) {
+		return;
+	}
+
+	if (per_cpu(current_vcpu, cpu) == vcpu) {
+		per_cpu(current_vcpu, cpu) = NULL;
+	}
+
+	if (vmcs_clear(__pa(vcpu->vmcs))) {
+		printk("vmclear failed on cpu %d\n", cpu);
+	}
+
+	list_del(&vcpu->loaded_list);
+
+	/* the VMCS is in memory before anyone sees it as inactive */
+	smp_wmb();
+
+	vcpu->cpu = -1;
+	vcpu->launched = 0;
+
+	return;
+}
+
+/*
+ * Flushes the vCPU's VMCS to memory and makes it inactive on the CPU
+ * it was last loaded on, so it can be loaded on another one.
+ */
+static void peach_vcpu_clear(struct peach_vcpu *vcpu)
+{
+	int cpu;
+
+	cpu = READ_ONCE(vcpu->cpu);
+	if (cpu >= 0) {
+		smp_call_function_single(cpu, __peach_vcpu_clear, vcpu, 1);
+	}
+
+	return;
+}
+
+/*
+ * Makes the vCPU's VMCS current on this CPU and keeps preemption disabled
+ * until peach_vcpu_put(). VMX operation is on for as long as a CPU is
+ * online, and a VMCS stays active on the CPU it last ran on after put,
+ * so a vCPU that comes back to the same CPU keeps its launch state and
+ * host state and at most needs a VMPTRLD. Only a vCPU the scheduler
+ * moved is cleared on its old CPU first, and gets this CPU's host state
+ * and a flush of translations that may be stale here.
+ */
+static void peach_vcpu_load(struct peach_vcpu *vcpu)
+{
+	int cpu;
+	int moved;
+
+	cpu = get_cpu();
+
+	moved = vcpu->cpu != cpu;
+	if (moved) {
+		peach_vcpu_clear(vcpu);
+
+		/* pairs with the barrier in __peach_vcpu_clear() */
+		smp_rmb();
+
+		local_irq_disable();
+		list_add(&vcpu->loaded_list, &per_cpu(loaded_vcpus, cpu));
+		local_irq_enable();
+
+		vcpu->cpu = cpu;
+	}
+
+	if (this_cpu_read(current_vcpu) != vcpu) {
+		if (vmcs_load(__pa(vcpu->vmcs))) {
+			printk("vmptrld failed on cpu %d\n", cpu);
+		}
+
+		this_cpu_write(current_vcpu, vcpu);
+	}
+
+	peach_vcpu_set_host_state(vcpu, moved);
+
+	/*
+	 * This CPU may still cache translations for our EPT root from before
+	 * the last change, but only if it was marked since it last flushed
+	 * them. Guest-linear translations of this vCPU are stale here if the
+	 * guest changed its page tables while it ran elsewhere; INVVPID drops
+	 * just those and leaves the other vCPUs' alone.
+	 */
+	if (moved) {
+		/* a full barrier, the mark is seen by peach_vm_flush_ept() */
+		cpumask_test_and_set_cpu(cpu, &vcpu->vm->ran_on);
+
+		vcpu->ept_gen = READ_ONCE(vcpu->vm->ept_gen);
+
+		/* a full barrier, pairs with the one in peach_vm_flush_ept() */
+		if (cpumask_test_and_clear_cpu(cpu, &vcpu->vm->ept_stale)) {
+			invept(vmx_invept_type, vcpu->vm->ept_pointer);
+		}
+
+		if (vcpu->vpid) {
+			invvpid(vmx_invvpid_type, vcpu->vpid);
+		}
+	}
+
+	return;
+}
+
+/*
+ * The VMCS stays active on this CPU until the vCPU moves or is destroyed.
+ * The guest's FPU state does not outlive the preemption-disabled section
+ * though, since the host may need the registers as soon as it ends.
+ */
+static void peach_vcpu_put(struct peach_vcpu *vcpu)
+{
+	if (vcpu->fpu_loaded) {
+		peach_vcpu_save_fpu(vcpu);
+	}
+
+	if (vcpu->msrs_loaded) {
+		peach_vcpu_put_msrs(vcpu);
+	}
+
+	put_cpu();
+
+	return;
+}
+
+/*
+ * Puts the guest's MSRs into the registers before its first entry since
+ * the vCPU was loaded. Only syscall_msrs[] that differ from what this CPU
+ * holds are written.
+ */
+static void peach_vcpu_load_msrs(struct peach_vcpu *vcpu)
+{
+	int i;
+
+	struct syscall_msrs *sm = this_cpu_ptr(&syscall_msrs_cache);
+
+	for (i = 0; i < ARRAY_SIZE(syscall_msrs); i++) {
+		if (vcpu->guest_syscall_msrs[i] != sm->values[i]) {
+			peach_write_syscall_msr(i, vcpu->guest_syscall_msrs[i]);
+		}
+	}
+
+	if (vcpu->guest_kernel_gs_base != vcpu->host_kernel_gs_base) {
+		wrmsrq(MSR_KERNEL_GS_BASE, vcpu->guest_kernel_gs_base);
+	}
+
+	vcpu->msrs_loaded = 1;
+
+	return;
+}
+
+/*
+ * Gives the task its MSR_KERNEL_GS_BASE back before it can be switched
+ * out. The guest may have changed its own with SWAPGS or WRMSR.
+ */
+static void peach_vcpu_put_msrs(struct peach_vcpu *vcpu)
+{
+	rdmsrq(MSR_KERNEL_GS_BASE, vcpu->guest_kernel_gs_base);
+	if (vcpu->guest_kernel_gs_base != vcpu->host_kernel_gs_base) {
+		wrmsrq(MSR_KERNEL_GS_BASE, vcpu->host_kernel_gs_base);
+	}
+
+	vcpu->msrs_loaded = 0;
+
+	return;
+}
+
+/*
+ * Writes syscall_msrs[i] on this CPU, which gets the host's value back
+ * the next time it returns to user mode. Called with preemption disabled.
+ */
+static void peach_write_syscall_msr(int i, u64 value)
+{
+	struct syscall_msrs *sm = this_cpu_ptr(&syscall_msrs_cache);
+
+	wrmsrq(syscall_msrs[i], value);
+	sm->values[i] = value;
+
+	if (!sm->registered) {
+		sm->urn.on_user_return = peach_on_user_return;
+		user_return_notifier_register(&sm->urn);
+		sm->registered = 1;
+	}
+
+	return;
+}
+
+/*
+ * Puts the host's syscall_msrs[] back on this CPU. Runs on the way to user
+ * mode, and on a CPU going offline.
+ */
+static void peach_on_user_return(struct user_return_notifier *urn)
+{
+	int i;
+	unsigned long flags;
+
+	struct syscall_msrs *sm = container_of(urn, struct syscall_msrs, urn);
+	struct host_state *hs = this_cpu_ptr(&host_state);
+
+	local_irq_save(flags);
+
+	if (sm->registered) {
+		user_return_notifier_unregister(urn);
+		sm->registered = 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(syscall_msrs); i++) {
+		if (sm->values[i] != hs->syscall_msrs[i]) {
+			wrmsrq(syscall_msrs[i], hs->syscall_msrs[i]);
+			sm->values[i] = hs->syscall_msrs[i];
+		}
+	}
+
+	local_irq_restore(flags);
+
+	return;
+}
+
+/*
+ * Called on the guest's first FPU use in a PEACH_RUN. The guest runs with
+ * CR0.TS set and #NM intercepted until then, so guests and exits that do
+ * not use the FPU never pay for switching the state. The guest sees the
+ * TS of its read shadow instead, see handle_cr(). From here on the run
+ * loop keeps the guest's state loaded until PEACH_RUN returns.
+ */
+static void peach_vcpu_activate_fpu(struct peach_vcpu *vcpu)
+{
+	/* a guest that set TS itself takes the next #NM directly */
+	if (!(vmcs_read(CR0_READ_SHADOW) & X86_CR0_TS)) {
+		vmcs_write(GUEST_CR0, vmcs_read(GUEST_CR0) & ~X86_CR0_TS);
+	}
+
+	vmcs_write(EXCEPTION_BITMAP, 0);
+
+	vcpu->fpu_active = 1;
+
+	return;
+}
+
+/* Called before PEACH_RUN returns, the next one starts out lazy again. */
+static void peach_vcpu_deactivate_fpu(struct peach_vcpu *vcpu)
+{
+	vmcs_write(GUEST_CR0, vmcs_read(GUEST_CR0) | X86_CR0_TS);
+	vmcs_write(EXCEPTION_BITMAP, 1U << NM_VECTOR);
+
+	vcpu->fpu_active = 0;
+
+	return;
+}
+
+/*
+ * Puts the guest's FPU state into the registers, inside a kernel-FPU
+ * section that stays open across exits handled in the kernel. It ends in
+ * peach_vcpu_save_fpu() on put, or after an exit that left softirqs
+ * pending, which cannot run inside it. Both are called with interrupts
+ * enabled. PKRU stays out of the restore, the host keeps using its own
+ * for user accesses; the run loop switches it separately.
+ */
+static void peach_vcpu_load_fpu(struct peach_vcpu *vcpu)
+{
+	/* saves the task's user state, which is restored on return to user */
+	kernel_fpu_begin();
+
+	if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+		asm volatile ("xrstor64 %0\n\t"
+			: : "m" (*(u8 *) vcpu->guest_fpu),
+			"a" ((u32) ~XFEATURE_MASK_PKRU), "d" (-1)
+			: "memory");
+	} else {
+		asm volatile ("fxrstor64 %0\n\t"
+			: : "m" (*(u8 *) vcpu->guest_fpu) : "memory");
+	}
+
+	vcpu->fpu_loaded = 1;
+
+	return;
+}
+
+/*
+ * Saves the guest's FPU state and gives the registers back to the host.
+ * XSAVEOPT skips the components the guest left alone since they were
+ * restored.
+ */
+static void peach_vcpu_save_fpu(struct peach_vcpu *vcpu)
+{
+	if (boot_cpu_has(X86_FEATURE_XSAVEOPT)) {
+		asm volatile ("xsaveopt64 %0\n\t"
+			: "+m" (*(u8 *) vcpu->guest_fpu)
+			: "a" ((u32) ~XFEATURE_MASK_PKRU), "d" (-1)
+			: "memory");
+	} else if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+		asm volatile ("xsave64 %0\n\t"
+			: "+m" (*(u8 *) vcpu->guest_fpu)
+			: "a" ((u32) ~XFEATURE_MASK_PKRU), "d" (-1)
+			: "memory");
+	} else {
+		asm volatile ("fxsave64 %0\n\t"
+			: "+m" (*(u8 *) vcpu->guest_fpu) : : "memory");
+	}
+
+	kernel_fpu_end();
+
+	vcpu->fpu_loaded = 0;
+
+	return;
+}
+
+/*
+ * Writes the guest-state area and the VM-execution, VM-exit and VM-entry
+ * controls. This is done once per vCPU; VMCLEAR keeps the contents, so
+ * later runs only need to reload the host state.
+ */
+static void peach_vcpu_setup_vmcs(struct peach_vcpu *vcpu)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(guest_state_table); i++) {
+		vmcs_write(guest_state_table[i].field,
+				guest_state_table[i].value);
+	}
+
+	vmcs_write(PIN_BASED_VM_EXEC_CONTROL, vmcs_config.pin_based &
+			~PIN_BASED_VMX_PREEMPTION_TIMER);
+	vmcs_write(CPU_BASED_VM_EXEC_CONTROL, vmcs_config.cpu_based);
+	vmcs_write(SECONDARY_VM_EXEC_CONTROL, vmcs_config.cpu_based_2nd);
+	vmcs_write(VM_EXIT_CONTROLS, vmcs_config.vmexit);
+	vmcs_write(VM_ENTRY_CONTROLS, vmcs_config.vmentry);
+
+	vmcs_write(EPT_POINTER, vcpu->vm->ept_pointer);
+
+	/* CR0.TS belongs to the host, see peach_vcpu_activate_fpu() */
+	vmcs_write(CR0_GUEST_HOST_MASK, X86_CR0_TS);
+	vmcs_write(CR0_READ_SHADOW, vmcs_read(GUEST_CR0));
+	vmcs_write(GUEST_CR0, vmcs_read(GUEST_CR0) | X86_CR0_TS);
+	vmcs_write(EXCEPTION_BITMAP, 1U << NM_VECTOR);
+
+	/* so does CR4.VMXE, which the guest always reads as clear */
+	vmcs_write(CR4_GUEST_HOST_MASK, X86_CR4_VMXE);
+	vmcs_write(CR4_READ_SHADOW, 0);
+
+	if (vcpu->vpid) {
+		vmcs_write(VIRTUAL_PROCESSOR_ID, vcpu->vpid);
+	} else {
+		vmcs_write(SECONDARY_VM_EXEC_CONTROL, vmcs_config.cpu_based_2nd &
+				~SECONDARY_EXEC_ENABLE_VPID);
+	}
+
+	if (vmcs_config.cpu_based_2nd & SECONDARY_EXEC_ENABLE_PML) {
+		vmcs_write(PML_ADDRESS, __pa(vcpu->pml_buffer));
+		vmcs_write(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+	}
+
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		vmcs_write(GUEST_IA32_EFER, 0);
+	}
+
+	if (vcpu->vm->msr_bitmap) {
+		vmcs_write(MSR_BITMAP, __pa(vcpu->vm->msr_bitmap));
+	}
+
+	if (vcpu->vm->io_bitmap) {
+		vmcs_write(IO_BITMAP_A, __pa(vcpu->vm->io_bitmap));
+		vmcs_write(IO_BITMAP_B, __pa(vcpu->vm->io_bitmap) + PAGE_SIZE);
+	}
+
+	return;
+}
+
+static void host_state_add(struct host_state *hs, u32 field, u64 value)
+{
+	hs->fields[hs->nr_fields].field = field;
+	hs->fields[hs->nr_fields].value = value;
+	hs->nr_fields++;
+
+	return;
+}
+
+/*
+ * Captures the host state of the CPU this runs on. The selectors go in
+ * with RPL and TI cleared, as VM entry requires.
+ */
+static void peach_capture_host_state(struct host_state *hs)
+{
+	int i;
+
+	u8 xdtr[10];
+
+	u64 value;
+	u64 tr_selector;
+	u64 gdt_base;
+	u64 tr_desc;
+
+	hs->nr_fields = 0;
+
+	asm volatile ("movq %%es, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_ES_SELECTOR, value & 0xF8);
+
+	asm volatile ("movq %%cs, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_CS_SELECTOR, value & 0xF8);
+
+	asm volatile ("movq %%ss, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_SS_SELECTOR, value & 0xF8);
+
+	asm volatile ("movq %%ds, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_DS_SELECTOR, value & 0xF8);
+
+	asm volatile ("movq %%fs, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_FS_SELECTOR, value & 0xF8);
+
+	asm volatile ("movq %%gs, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_GS_SELECTOR, value & 0xF8);
+
+	asm volatile ("str %0\n\t" : "=a" (tr_selector));
+	tr_selector &= 0xF8;
+	host_state_add(hs, HOST_TR_SELECTOR, tr_selector);
+
+	asm volatile ("sgdt %0\n\t" : "=m" (xdtr));
+	gdt_base = *((u64 *) (xdtr + 2));
+	host_state_add(hs, HOST_GDTR_BASE, gdt_base);
+
+	/* the 64-bit TSS descriptor spreads its base over both quadwords */
+	tr_desc = *((u64 *) (gdt_base + tr_selector));
+	value = ((tr_desc & 0x000000FFFFFF0000) >> 16) | ((tr_desc & 0xFF00000000000000) >> 32);
+	tr_desc = *((u64 *) (gdt_base + tr_selector + 8));
+	value |= tr_desc << 32;
+	host_state_add(hs, HOST_TR_BASE, value);
+
+	asm volatile ("sidt %0\n\t" : "=m" (xdtr));
+	host_state_add(hs, HOST_IDTR_BASE, *((u64 *) (xdtr + 2)));
+
+	asm volatile ("movq %%cr0, %0\n\t" : "=a" (value));
+	host_state_add(hs, HOST_CR0, value);
+
+	/* the kernel's GS base points to this CPU's per-CPU area */
+	rdmsrq(MSR_GS_BASE, value);
+	host_state_add(hs, HOST_GS_BASE, value);
+
+	rdmsrq(MSR_IA32_SYSENTER_CS, value);
+	host_state_add(hs, HOST_IA32_SYSENTER_CS, value);
+	rdmsrq(MSR_IA32_SYSENTER_ESP, value);
+	host_state_add(hs, HOST_IA32_SYSENTER_ESP, value);
+	rdmsrq(MSR_IA32_SYSENTER_EIP, value);
+	host_state_add(hs, HOST_IA32_SYSENTER_EIP, value);
+
+	if (vmcs_config.vmexit & VM_EXIT_LOAD_IA32_EFER) {
+		rdmsrq(MSR_EFER, value);
+		host_state_add(hs, HOST_IA32_EFER, value);
+	}
+
+	host_state_add(hs, HOST_RIP, (u64) _vmexit_handler);
+
+	/* with a guest's loaded, the host's were captured before */
+	if (!this_cpu_read(syscall_msrs_cache.registered)) {
+		for (i = 0; i < ARRAY_SIZE(syscall_msrs); i++) {
+			rdmsrq(syscall_msrs[i], hs->syscall_msrs[i]);
+		}
+
+		memcpy(this_cpu_ptr(&syscall_msrs_cache)->values,
+				hs->syscall_msrs, sizeof(hs->syscall_msrs));
+	}
+
+	return;
+}
+
+/*
+ * Puts the CPU in VMX operation for as long as it is online. Dynamic
+ * hotplug callbacks run on the CPU coming online.
+ */
+static int peach_cpu_online(unsigned int cpu)
+{
+	u64 vmxon_pa;
+
+	u8 error;
+
+	/* another hypervisor owns VMX on this CPU */
+	if (cr4_read_shadow() & X86_CR4_VMXE) {
+		printk("VMX is already in use on cpu %u\n", cpu);
+
+		return -EBUSY;
+	}
+
+	INIT_LIST_HEAD(&per_cpu(loaded_vcpus, cpu));
+
+	vmxon_pa = __pa(per_cpu(vmxon, cpu));
+
+	cr4_set_bits(X86_CR4_VMXE);
+
+	asm volatile (
+		"vmxon %[pa]; setna %[error]"
+		: [error] "=rm" (error)
+		: [pa] "m" (vmxon_pa)
+		: "cc", "memory"
+	);
+	if (error) {
+		printk("vmxon failed on cpu %u\n", cpu);
+
+		cr4_clear_bits(X86_CR4_VMXE);
+
+		return -EIO;
+	}
+
+	peach_capture_host_state(per_cpu_ptr(&host_state, cpu));
+
+	return 0;
+}
+
+/*
+ * Leaves VMX operation on a CPU going offline or when the module is
+ * unloaded. Every VMCS still active here is written back to memory
+ * first; no vCPU can be loaded here any more.
+ */
+static int peach_cpu_offline(unsigned int cpu)
+{
+	struct peach_vcpu *vcpu;
+	struct peach_vcpu *next;
+
+	/* the notifier must not outlive the module */
+	if (this_cpu_read(syscall_msrs_cache.registered)) {
+		peach_on_user_return(this_cpu_ptr(&syscall_msrs_cache.urn));
+	}
+
+	local_irq_disable();
+
+	list_for_each_entry_safe(vcpu, next, &per_cpu(loaded_vcpus, cpu),
+			loaded_list) {
+		__peach_vcpu_clear(vcpu);
+	}
+
+	local_irq_enable();
+
+	asm volatile ("vmxoff" : : : "cc", "memory");
+
+	cr4_clear_bits(X86_CR4_VMXE);
+
+	return 0;
+}
+
+/*
+ * Writes the host-state area for the CPU the vCPU was just loaded on.
+ * The per-CPU part comes from the template and only has to be written
+ * when the VMCS moved here from another CPU; CR3, CR4 and the FS base
+ * belong to the calling task and are written on every load. HOST_RSP
+ * is left to _peach_vcpu_run(), which knows the stack pointer it wants
+ * to get back.
+ */
+static void peach_vcpu_set_host_state(struct peach_vcpu *vcpu, int moved)
+{
+	int i;
+
+	u64 value;
+
+	struct host_state *hs;
+
+	if (moved) {
+		hs = this_cpu_ptr(&host_state);
+
+		/* only until the hotplug callback ran on a new CPU */
+		if (!hs->nr_fields) {
+			peach_capture_host_state(hs);
+		}
+
+		for (i = 0; i < hs->nr_fields; i++) {
+			vmcs_write(hs->fields[i].field, hs->fields[i].value);
+		}
+	}
+
+	asm volatile ("movq %%cr3, %0\n\t" : "=a" (value));
+	vmcs_write(HOST_CR3, value);
+
+	asm volatile ("movq %%cr4, %0\n\t" : "=a" (value));
+	vmcs_write(HOST_CR4, value);
+
+	rdmsrq(MSR_FS_BASE, value);
+	vmcs_write(HOST_FS_BASE, value);
+
+	return;
+}
+
+/*
+ * Queues the interrupt and makes the vCPU deliver it: a vCPU in the
+ * guest is kicked out, a halted one woken up, and either checks the
+ * queue before it enters the guest again.
+ */
+static long peach_vcpu_queue_irq(struct peach_vcpu *vcpu,
+			struct peach_irq *irq)
+{
+	if (irq->vector < 32 || irq->vector > 255) {
+		return -EINVAL;
+	}
+
+	set_bit(irq->vector, vcpu->pending_irqs);
+
+	/* pairs with the barrier between setting IN_GUEST_MODE and the check */
+	smp_mb__after_atomic();
+
+	peach_vcpu_wake(vcpu);
+
+	return 0;
+}
+
+static void peach_vcpu_set_irq_window(struct peach_vcpu *vcpu, int on)
+{
+	u32 ctl;
+
+	if (vcpu->irq_window == on) {
+		return;
+	}
+
+	ctl = vmcs_read(CPU_BASED_VM_EXEC_CONTROL);
+	if (on) {
+		ctl |= CPU_BASED_INTR_WINDOW_EXITING;
+	} else {
+		ctl &= ~CPU_BASED_INTR_WINDOW_EXITING;
+	}
+	vmcs_write(CPU_BASED_VM_EXEC_CONTROL, ctl);
+
+	vcpu->irq_window = on;
+
+	return;
+}
+
+/*
+ * Called right before VM entry. Injects the highest queued vector if
+ * the guest can take an interrupt now. If it cannot, because RFLAGS.IF
+ * is clear, an STI or MOV SS blocks it or another event is being
+ * delivered, interrupt-window exiting brings the vCPU back as soon as
+ * it can. The window also stays open while vectors are left.
+ */
+static void peach_vcpu_inject_irq(struct peach_vcpu *vcpu)
+{
+	int vector;
+	int blocked;
+
+	if (bitmap_empty(vcpu->pending_irqs, 256)) {
+		peach_vcpu_set_irq_window(vcpu, 0);
+
+		return;
+	}
+
+	blocked = !(vmcs_read(GUEST_RFLAGS) & X86_EFLAGS_IF) ||
+		vmcs_read(GUEST_INTERRUPTIBILITY_INFO) &
+			(GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS) ||
+		vmcs_read(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK;
+
+	if (!blocked) {
+		vector = find_last_bit(vcpu->pending_irqs, 256);
+		clear_bit(vector, vcpu->pending_irqs);
+
+		vmcs_write(VM_ENTRY_INTR_INFO_FIELD,
+				vector | INTR_TYPE_EXT_INTR | INTR_INFO_VALID_MASK);
+	}
+
+	peach_vcpu_set_irq_window(vcpu,
+			!bitmap_empty(vcpu->pending_irqs, 256));
+
+	return;
+}
+
+/*
+ * Called right after a VM exit. An event whose delivery the exit
+ * interrupted, say by an EPT violation on the guest's stack, is
+ * delivered again on the next entry; every exit clears what was
+ * injected on the entry before.
+ */
+static void peach_vcpu_reinject(struct peach_vcpu *vcpu)
+{
+	u32 info;
+
+	info = vmcs_read(IDT_VECTORING_INFO_FIELD);
+	if (!(info & INTR_INFO_VALID_MASK)) {
+		return;
+	}
+
+	vmcs_write(VM_ENTRY_INTR_INFO_FIELD, info & ~INTR_INFO_UNBLOCK_NMI);
+
+	if (info & INTR_INFO_DELIVER_CODE_MASK) {
+		vmcs_write(VM_ENTRY_EXCEPTION_ERROR_CODE,
+				vmcs_read(IDT_VECTORING_ERROR_CODE));
+	}
+
+	/* only used for software interrupts and exceptions */
+	vmcs_write(VM_ENTRY_INSTRUCTION_LEN,
+			vmcs_read(VM_EXIT_INSTRUCTION_LEN));
+
+	return;
+}
+
+/*
+ * Runs the vCPU until an exit that userspace has to see. VM exits that
+ * can be handled in the kernel go straight back into the guest with
+ * VMRESUME; only the first entry after the VMCS was loaded needs
+ * VMLAUNCH.
+ */
+static int peach_vcpu_run(struct peach_vcpu *vcpu, struct peach_run *run)
+{
+	int ret;
+	int first;
+
+	u32 pin_based;
+
+	/* when the exit that is being handled happened, 0 if none is */
+	u64 exit_tsc = 0;
+	u64 entry_tsc;
+	u32 host_pkru = 0;
+
+	if (run->budget && !(vmcs_config.pin_based &
+				PIN_BASED_VMX_PREEMPTION_TIMER)) {
+		return -EOPNOTSUPP;
+	}
+
+	vcpu->budget = run->budget;
+
+	WRITE_ONCE(vcpu->in_run, 1);
+
+	/* the task's user GS base, which stays the same for the whole run */
+	rdmsrq(MSR_KERNEL_GS_BASE, vcpu->host_kernel_gs_base);
+
+	peach_vcpu_load(vcpu);
+
+	if (!vcpu->vmcs_ready) {
+		peach_vcpu_setup_vmcs(vcpu);
+		vcpu->vmcs_ready = 1;
+	}
+
+	/* the timer only runs while the guest does, so it measures guest time */
+	pin_based = vmcs_config.pin_based & ~PIN_BASED_VMX_PREEMPTION_TIMER;
+	if (run->budget) {
+		pin_based |= PIN_BASED_VMX_PREEMPTION_TIMER;
+	}
+	vmcs_write(PIN_BASED_VM_EXEC_CONTROL, pin_based);
+
+	if (vcpu->pending_read) {
+		peach_vcpu_complete_read(vcpu, run);
+	}
+
+	for (;;) {
+		if (vcpu->fpu_active && !vcpu->fpu_loaded) {
+			peach_vcpu_load_fpu(vcpu);
+		}
+
+		/*
+		 * External interrupts exit the guest but are not acknowledged,
+		 * so they stay pending until interrupts are enabled again
+		 * below and the host services them as usual.
+		 */
+		local_irq_disable();
+
+		/* pairs with the barrier in peach_vm_flush_ept() */
+		smp_store_mb(vcpu->mode, IN_GUEST_MODE);
+
+		if (READ_ONCE(vcpu->vm->shutdown)) {
+			WRITE_ONCE(vcpu->mode, OUTSIDE_GUEST_MODE);
+			local_irq_enable();
+
+			run->exit_reason = PEACH_EXIT_SHUTDOWN;
+			ret = 0;
+
+			break;
+		}
+
+		/* the kick misses a vCPU that is not in the guest yet */
+		if (READ_ONCE(vcpu->pml_drain)) {
+			WRITE_ONCE(vcpu->mode, OUTSIDE_GUEST_MODE);
+			local_irq_enable();
+
+			peach_vcpu_flush_pml(vcpu);
+
+			continue;
+		}
+
+		/* what is left is less than a tick of the timer */
+		if (run->budget && !(vcpu->budget >> vmx_preemption_timer_rate)) {
+			WRITE_ONCE(vcpu->mode, OUTSIDE_GUEST_MODE);
+			local_irq_enable();
+
+			run->exit_reason = PEACH_EXIT_TIMER;
+			ret = 0;
+
+			break;
+		}
+
+		peach_vcpu_inject_irq(vcpu);
+
+		if (run->budget) {
+			vmcs_write(VMX_PREEMPTION_TIMER_VALUE,
+					min_t(u64, vcpu->budget >>
+						vmx_preemption_timer_rate, U32_MAX));
+		}
+
+		if (vcpu->ept_gen != READ_ONCE(vcpu->vm->ept_gen)) {
+			vcpu->ept_gen = READ_ONCE(vcpu->vm->ept_gen);
+			invept(vmx_invept_type, vcpu->vm->ept_pointer);
+		}
+
+		if (exit_tsc) {
+			peach_vcpu_account_exit(vcpu, rdtsc() - exit_tsc);
+			exit_tsc = 0;
+		}
+
+		if (!vcpu->msrs_loaded) {
+			peach_vcpu_load_msrs(vcpu);
+		}
+
+		/* user accesses of the host must not run under the guest's PKRU */
+		if (boot_cpu_has(X86_FEATURE_OSPKE)) {
+			host_pkru = rdpkru();
+			if (vcpu->guest_pkru != host_pkru) {
+				wrpkru(vcpu->guest_pkru);
+			}
+		}
+
+		entry_tsc = rdtsc();
+
+		ret = _peach_vcpu_run(&vcpu->regs, vcpu->launched);
+
+		if (boot_cpu_has(X86_FEATURE_OSPKE)) {
+			vcpu->guest_pkru = rdpkru();
+			if (vcpu->guest_pkru != host_pkru) {
+				wrpkru(host_pkru);
+			}
+		}
+
+		WRITE_ONCE(vcpu->mode, OUTSIDE_GUEST_MODE);
+
+		if (ret) {
+			local_irq_enable();
+
+			run->exit_reason = PEACH_EXIT_FAIL_ENTRY;
+			run->fail_entry.hardware_entry_failure_reason = 0;
+			run->fail_entry.instruction_error =
+				vmcs_read(VM_INSTRUCTION_ERROR);
+
+			break;
+		}
+
+		exit_tsc = rdtsc();
+
+		vcpu->budget -= min(vcpu->budget, exit_tsc - entry_tsc);
+
+		vcpu->launched = 1;
+		vcpu->exit_reason = vmcs_read(VM_EXIT_REASON);
+
+		peach_vcpu_reinject(vcpu);
+
+		/*
+		 * An NMI that exited the guest is the host's, hand it over.
+		 * With FRED the kernel's NMI entry cannot be reached through
+		 * the IDT, and has to be called with a FRED frame instead.
+		 */
+		if ((vcpu->exit_reason & VMX_EXIT_REASONS_BASIC_MASK) ==
+				EXIT_REASON_EXCEPTION_NMI &&
+				(vmcs_read(VM_EXIT_INTR_INFO) &
+				 (INTR_INFO_INTR_TYPE_MASK | INTR_INFO_VALID_MASK)) ==
+				(INTR_TYPE_NMI_INTR | INTR_INFO_VALID_MASK)) {
+			if (cpu_feature_enabled(X86_FEATURE_FRED)) {
+				fred_entry_from_kvm(EVENT_TYPE_NMI, NMI_VECTOR);
+			} else {
+				asm volatile ("int $2");
+			}
+		}
+
+		local_irq_enable();
+
+		/* softirqs raised while the guest ran wait for the FPU section */
+		if (vcpu->fpu_loaded && local_softirq_pending()) {
+			peach_vcpu_save_fpu(vcpu);
+		}
+
+		ret = handle_vmexit(vcpu, run);
+		if (ret <= 0) {
+			break;
+		}
+
+		if (signal_pending(current)) {
+			run->exit_reason = PEACH_EXIT_INTR;
+
+			break;
+		}
+
+		if (need_resched()) {
+			peach_vcpu_put(vcpu);
+			cond_resched();
+			peach_vcpu_load(vcpu);
+		}
+	}
+
+	first = PML_ENTITY_NUM;
+	if (enable_pml) {
+		first = peach_vcpu_take_pml(vcpu);
+	}
+
+	if (vcpu->fpu_active) {
+		peach_vcpu_deactivate_fpu(vcpu);
+	}
+
+	peach_vcpu_put(vcpu);
+
+	/* whatever the guest wrote is in the dirty log once PEACH_RUN returns */
+	if (first < PML_ENTITY_NUM) {
+		peach_vcpu_mark_pml(vcpu, first);
+	}
+
+	smp_store_release(&vcpu->in_run, 0);
+	wake_up_all(&vcpu->vm->pml_wq);
+
+	if (exit_tsc) {
+		peach_vcpu_account_exit(vcpu, rdtsc() - exit_tsc);
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Counts the exit in vcpu->exit_reason, which took cycles to handle. */
+static void peach_vcpu_account_exit(struct peach_vcpu *vcpu, u64 cycles)
+{
+	int bucket;
+	u32 reason;
+
+	struct peach_exit_stats *exit;
+
+	reason = vcpu->exit_reason & VMX_EXIT_REASONS_BASIC_MASK;
+	if (vcpu->exit_reason & VMX_EXIT_REASONS_FAILED_VMENTRY ||
+			reason >= PEACH_STATS_EXIT_REASONS) {
+		return;
+	}
+
+	bucket = ilog2(cycles | 1) - (PEACH_STATS_SHIFT - 1);
+	bucket = clamp(bucket, 0, PEACH_STATS_BUCKETS - 1);
+
+	exit = &vcpu->stats->exits[reason];
+	exit->count++;
+	exit->cycles += cycles;
+	exit->histogram[bucket]++;
+
+	return;
+}
+
+/*
+ * The guest registers in the order of their x86 register numbers. RSP
+ * lives in the VMCS and is never the target of an emulated access.
+ */
+static const int guest_reg_offsets[16] = {
+	offsetof(struct guest_regs, rax),
+	offsetof(struct guest_regs, rcx),
+	offsetof(struct guest_regs, rdx),
+	offsetof(struct guest_regs, rbx),
+	-1,
+	offsetof(struct guest_regs, rbp),
+	offsetof(struct guest_regs, rsi),
+	offsetof(struct guest_regs, rdi),
+	offsetof(struct guest_regs, r8),
+	offsetof(struct guest_regs, r9),
+	offsetof(struct guest_regs, r10),
+	offsetof(struct guest_regs, r11),
+	offsetof(struct guest_regs, r12),
+	offsetof(struct guest_regs, r13),
+	offsetof(struct guest_regs, r14),
+	offsetof(struct guest_regs, r15),
+};
+
+static inline u64 *guest_reg(struct peach_vcpu *vcpu, int reg)
+{
+	return (u64 *) ((char *) &vcpu->regs + guest_reg_offsets[reg]);
+}
+
+/*
+ * Loads size bytes of value into bits shift and up of the register, the
+ * way a MOV or IN does: 32-bit writes clear the upper half, narrower
+ * ones leave the rest of the register alone.
+ */
+static void guest_reg_write(u64 *reg, int shift, int size, u64 value)
+{
+	u64 mask;
+
+	if (size == 8) {
+		*reg = value;
+	} else if (size == 4) {
+		*reg = (u32) value;
+	} else {
+		mask = ((1ULL << (size * 8)) - 1) << shift;
+		*reg = (*reg & ~mask) | ((value << shift) & mask);
+	}
+
+	return;
+}
+
+/* Finishes the read that went to userspace with the data it supplied. */
+static void peach_vcpu_complete_read(struct peach_vcpu *vcpu,
+			struct peach_run *run)
+{
+	u64 value = 0;
+
+	if (vcpu->pending_read == PEACH_EXIT_MSR) {
+		vcpu->regs.rax = (u32) run->msr.data;
+		vcpu->regs.rdx = run->msr.data >> 32;
+		vcpu->pending_read = 0;
+
+		return;
+	}
+
+	if (vcpu->pending_read == PEACH_EXIT_IO) {
+		value = run->io.data;
+	} else {
+		memcpy(&value, run->mmio.data, vcpu->pending_size);
+	}
+
+	guest_reg_write(guest_reg(vcpu, vcpu->pending_reg),
+			vcpu->pending_shift, vcpu->pending_size, value);
+
+	vcpu->pending_read = 0;
+
+	return;
+}
+
+/*
+ * Resets the vCPU's page-modification log and returns the index of the
+ * oldest entry in it, or PML_ENTITY_NUM if it is empty. The processor
+ * fills the log from the last entry down, and the index wraps around to
+ * 0xFFFF once the first entry is written. The VMCS must be current and
+ * the entries must be consumed before the guest runs again.
+ */
+static int peach_vcpu_take_pml(struct peach_vcpu *vcpu)
+{
+	u16 index;
+
+	index = vmcs_read(GUEST_PML_INDEX);
+	if (index == PML_ENTITY_NUM - 1) {
+		return PML_ENTITY_NUM;
+	}
+
+	vmcs_write(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+
+	return index >= PML_ENTITY_NUM ? 0 : index + 1;
+}
+
+/* Records the entries taken by peach_vcpu_take_pml() in the dirty logs. */
+static void peach_vcpu_mark_pml(struct peach_vcpu *vcpu, int first)
+{
+	int i;
+
+	u64 gfn;
+
+	struct peach_vm *vm;
+	struct peach_memslot *slot;
+
+	vm = vcpu->vm;
+
+	mutex_lock(&vm->mmu_lock);
+
+	for (i = first; i < PML_ENTITY_NUM; i++) {
+		gfn = vcpu->pml_buffer[i] >> PAGE_SHIFT;
+
+		slot = peach_gfn_to_memslot(vm, gfn);
+		if (slot && slot->dirty_bitmap) {
+			set_bit(gfn - slot->base_gfn, slot->dirty_bitmap);
+		}
+	}
+
+	mutex_unlock(&vm->mmu_lock);
+
+	return;
+}
+
+/*
+ * Drains the log of a loaded vCPU, which is loaded again afterwards, and
+ * lets peach_vm_drain_pml() know.
+ */
+static void peach_vcpu_flush_pml(struct peach_vcpu *vcpu)
+{
+	int first;
+
+	first = peach_vcpu_take_pml(vcpu);
+	if (first < PML_ENTITY_NUM) {
+		/* mmu_lock may sleep */
+		peach_vcpu_put(vcpu);
+		peach_vcpu_mark_pml(vcpu, first);
+		peach_vcpu_load(vcpu);
+	}
+
+	/* the guest has not run since the log was taken */
+	smp_store_release(&vcpu->pml_drain, 0);
+	wake_up_all(&vcpu->vm->pml_wq);
+
+	return;
+}
+
+/*
+ * Handles a VM exit in the kernel. Returns 1 to resume the guest, 0
+ * once *run describes an exit that has to go to userspace, or a
+ * negative error that PEACH_RUN fails with.
+ */
+static int handle_vmexit(struct peach_vcpu *vcpu, struct peach_run *run)
+{
+	u64 exit_reason;
+
+	exit_reason = vcpu->exit_reason;
+
+	if (exit_reason & VMX_EXIT_REASONS_FAILED_VMENTRY) {
+		run->exit_reason = PEACH_EXIT_FAIL_ENTRY;
+		run->fail_entry.hardware_entry_failure_reason = exit_reason;
+		run->fail_entry.instruction_error = 0;
+
+		return 0;
+	}
+
+	switch (exit_reason & VMX_EXIT_REASONS_BASIC_MASK) {
+	case EXIT_REASON_EXCEPTION_NMI:
+		/* already handled by the host before interrupts were enabled */
+		if ((vmcs_read(VM_EXIT_INTR_INFO) & INTR_INFO_INTR_TYPE_MASK) ==
+				INTR_TYPE_NMI_INTR) {
+			return 1;
+		}
+
+		/* #NM is the only exception intercepted */
+		if ((vmcs_read(VM_EXIT_INTR_INFO) & INTR_INFO_VECTOR_MASK) ==
+				NM_VECTOR && !vcpu->fpu_active) {
+			peach_vcpu_activate_fpu(vcpu);
+
+			return 1;
+		}
+
+		goto unknown;
+
+	case EXIT_REASON_EXTERNAL_INTERRUPT:
+		/* already serviced when interrupts were enabled again */
+		return 1;
+
+	case EXIT_REASON_INTERRUPT_WINDOW:
+		/* the vector is injected right before the next entry */
+		return 1;
+
+	case EXIT_REASON_TRIPLE_FAULT:
+		run->exit_reason = PEACH_EXIT_SHUTDOWN;
+
+		return 0;
+
+	case EXIT_REASON_CPUID:
+		handle_cpuid(vcpu);
+
+		return 1;
+
+	case EXIT_REASON_HLT:
+		return handle_hlt(vcpu);
+
+	case EXIT_REASON_VMCALL:
+		return handle_vmcall(vcpu, run);
+
+	case EXIT_REASON_CR_ACCESS:
+		if (handle_cr(vcpu)) {
+			return 1;
+		}
+
+		goto unknown;
+
+	case EXIT_REASON_IO_INSTRUCTION:
+		return handle_io(vcpu, run);
+
+	case EXIT_REASON_MSR_READ:
+	case EXIT_REASON_MSR_WRITE:
+		return handle_msr(vcpu, run);
+
+	case EXIT_REASON_EPT_VIOLATION:
+		return handle_ept_violation(vcpu, run);
+
+	case EXIT_REASON_PML_FULL:
+		peach_vcpu_flush_pml(vcpu);
+
+		return 1;
+
+	case EXIT_REASON_PREEMPTION_TIMER:
+		/* the budget is checked before the next entry */
+		return 1;
+
+	default:
+unknown:
+		dump_guest_regs(&vcpu->regs);
+		printk("EXIT_REASON = 0x%llx\n", exit_reason);
+
+		run->exit_reason = PEACH_EXIT_UNKNOWN;
+		run->hw.hardware_exit_reason = exit_reason;
+		run->hw.exit_qualification = vmcs_read(EXIT_QUALIFICATION);
+
+		return 0;
+	}
+}
+
+static void skip_emulated_instruction(struct peach_vcpu *vcpu)
+{
+	skip_instruction(vcpu, vmcs_read(VM_EXIT_INSTRUCTION_LEN));
+
+	return;
+}
+
+/*
+ * Moves the guest past the len bytes long instruction at RIP, which
+ * ends the interrupt shadow of an STI or MOV SS right before it.
+ */
+static void skip_instruction(struct peach_vcpu *vcpu, u64 len)
+{
+	u32 intr;
+
+	vmcs_write(GUEST_RIP, vmcs_read(GUEST_RIP) + len);
+
+	intr = vmcs_read(GUEST_INTERRUPTIBILITY_INFO);
+	if (intr & (GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS)) {
+		vmcs_write(GUEST_INTERRUPTIBILITY_INFO, intr &
+				~(GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS));
+	}
+
+	return;
+}
+
+/* Answers CPUID from the vCPU's table, which PEACH_RUN holds the lock for. */
+static void handle_cpuid(struct peach_vcpu *vcpu)
+{
+	u32 eax = 0;
+	u32 ebx = 0;
+	u32 ecx = 0;
+	u32 edx = 0;
+
+	u32 function;
+	u32 index;
+
+	struct peach_cpuid_entry *entry;
+
+	function = vcpu->regs.rax;
+	index = vcpu->regs.rcx;
+
+	entry = peach_vcpu_find_cpuid(vcpu, function, index);
+	if (entry) {
+		eax = entry->eax;
+		ebx = entry->ebx;
+		ecx = entry->ecx;
+		edx = entry->edx;
+	} else if (vcpu->cpuid_flags & PEACH_CPUID_HOST_PASSTHROUGH) {
+		cpuid_count(function, index, &eax, &ebx, &ecx, &edx);
+	}
+
+	/* like any 32-bit register write, CPUID clears the upper halves */
+	vcpu->regs.rax = eax;
+	vcpu->regs.rbx = ebx;
+	vcpu->regs.rcx = ecx;
+	vcpu->regs.rdx = edx;
+
+	skip_emulated_instruction(vcpu);
+
+	return;
+}
+
+/*
+ * HLT idles the vCPU until it has an event, see peach_vcpu_halt(). The
+ * HLT is only skipped once there is one; a signal leaves the guest in
+ * front of it, so it halts again when it is run next.
+ */
+static int handle_hlt(struct peach_vcpu *vcpu)
+{
+	int woken;
+
+	u64 len;
+
+	len = vmcs_read(VM_EXIT_INSTRUCTION_LEN);
+	vcpu->halt_irqs_on = !!(vmcs_read(GUEST_RFLAGS) & X86_EFLAGS_IF);
+
+	/* sleeping needs preemption enabled again */
+	peach_vcpu_put(vcpu);
+	woken = peach_vcpu_halt(vcpu);
+	peach_vcpu_load(vcpu);
+
+	if (woken) {
+		skip_instruction(vcpu, len);
+	}
+
+	return 1;
+}
+
+static int handle_vmcall(struct peach_vcpu *vcpu, struct peach_run *run)
+{
+	skip_emulated_instruction(vcpu);
+
+	switch (vcpu->regs.rax) {
+	case PEACH_HC_SHUTDOWN:
+		peach_vm_shutdown(vcpu->vm);
+
+		run->exit_reason = PEACH_EXIT_SHUTDOWN;
+
+		return 0;
+
+	default:
+		vcpu->regs.rax = PEACH_HC_ENOSYS;
+
+		return 1;
+	}
+}
+
+/*
+ * Port writes to a coalesced zone go to the ring and the guest carries
+ * on. Other accesses go to userspace; an IN is finished on the next
+ * PEACH_RUN with the data userspace put in run->io. The string forms
+ * are not emulated.
+ */
+static int handle_io(struct peach_vcpu *vcpu, struct peach_run *run)
+{
+	int size;
+
+	u16 port;
+	u64 qualification;
+
+	qualification = vmcs_read(EXIT_QUALIFICATION);
+
+	if (qualification & IO_QUAL_STRING) {
+		run->exit_reason = PEACH_EXIT_UNKNOWN;
+		run->hw.hardware_exit_reason = vcpu->exit_reason;
+		run->hw.exit_qualification = qualification;
+
+		return 0;
+	}
+
+	size = (qualification & IO_QUAL_SIZE_MASK) + 1;
+	port = qualification >> IO_QUAL_PORT_SHIFT;
+
+	skip_emulated_instruction(vcpu);
+
+	if (!(qualification & IO_QUAL_IN) && peach_coalesced_append(vcpu->vm,
+				port, size, 1, vcpu->regs.rax)) {
+		return 1;
+	}
+
+	run->exit_reason = PEACH_EXIT_IO;
+	run->io.size = size;
+	run->io.port = port;
+	run->io.data = 0;
+
+	if (qualification & IO_QUAL_IN) {
+		run->io.direction = PEACH_EXIT_IO_IN;
+
+		vcpu->pending_read = PEACH_EXIT_IO;
+		vcpu->pending_reg = 0;
+		vcpu->pending_shift = 0;
+		vcpu->pending_size = size;
+	} else {
+		run->io.direction = PEACH_EXIT_IO_OUT;
+		memcpy(&run->io.data, &vcpu->regs.rax, size);
+	}
+
+	return 0;
+}
+
+/*
+ * RDMSR and WRMSR that the MSR bitmap does not let through, or all of
+ * them without one, go to userspace, except for syscall_msrs[], which
+ * are handled here. An RDMSR is finished on the next PEACH_RUN with the
+ * data userspace put in run->msr.
+ */
+static int handle_msr(struct peach_vcpu *vcpu, struct peach_run *run)
+{
+	u64 data;
+	int i;
+
+	skip_emulated_instruction(vcpu);
+
+	data = (vcpu->regs.rdx << 32) | (u32) vcpu->regs.rax;
+
+	for (i = 0; i < ARRAY_SIZE(syscall_msrs); i++) {
+		if (syscall_msrs[i] != (u32) vcpu->regs.rcx) {
+			continue;
+		}
+
+		if ((vcpu->exit_reason & VMX_EXIT_REASONS_BASIC_MASK) ==
+				EXIT_REASON_MSR_WRITE) {
+			vcpu->guest_syscall_msrs[i] = data;
+
+			if (vcpu->msrs_loaded) {
+				peach_write_syscall_msr(i, data);
+			}
+		} else {
+			vcpu->regs.rax = (u32) vcpu->guest_syscall_msrs[i];
+			vcpu->regs.rdx = vcpu->guest_syscall_msrs[i] >> 32;
+		}
+
+		return 1;
+	}
+
+	run->exit_reason = PEACH_EXIT_MSR;
+	run->msr.index = vcpu->regs.rcx;
+	run->msr.data = 0;
+
+	if ((vcpu->exit_reason & VMX_EXIT_REASONS_BASIC_MASK) ==
+			EXIT_REASON_MSR_WRITE) {
+		run->msr.is_write = 1;
+		run->msr.data = data;
+	} else {
+		run->msr.is_write = 0;
+
+		vcpu->pending_read = PEACH_EXIT_MSR;
+	}
+
+	return 0;
+}
+
+/* The default operand and address size of the guest's code, in bits. */
+static int guest_code_size(void)
+{
+	u32 ar;
+
+	ar = vmcs_read(GUEST_CS_AR_BYTES);
+
+	if (vmcs_read(VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE &&
+			ar & VMX_AR_L) {
+		return 64;
+	}
+
+	return ar & VMX_AR_DB ? 32 : 16;
+}
+
+/*
+ * Control-register accesses exit only for the bits the host owns: a MOV
+ * to CR0, CLTS or LMSW that changes TS, or a MOV to CR4 that sets VMXE,
+ * which gets #GP as there is no nested VMX. The CR0 writes are emulated
+ * in full. Returns 0 for any other access, which goes to userspace.
+ */
+static int handle_cr(struct peach_vcpu *vcpu)
+{
+	int reg;
+
+	u64 cr0;
+	u64 value;
+	u64 qualification;
+
+	qualification = vmcs_read(EXIT_QUALIFICATION);
+
+	cr0 = (vmcs_read(GUEST_CR0) & ~X86_CR0_TS) |
+		(vmcs_read(CR0_READ_SHADOW) & X86_CR0_TS);
+
+	switch (qualification & CR_QUAL_ACCESS_MASK) {
+	case CR_QUAL_ACCESS_MOV_TO_CR:
+		reg = (qualification >> CR_QUAL_REG_SHIFT) & CR_QUAL_REG_MASK;
+		if (reg == 4) {
+			value = vmcs_read(GUEST_RSP);
+		} else {
+			value = *guest_reg(vcpu, reg);
+		}
+
+		if (guest_code_size() != 64) {
+			value = (u32) value;
+		}
+
+		switch (qualification & CR_QUAL_CR_MASK) {
+		case 0:
+			break;
+
+		case 4:
+			peach_vcpu_inject_gp(vcpu);
+
+			return 1;
+
+		default:
+			return 0;
+		}
+
+		break;
+
+	case CR_QUAL_ACCESS_CLTS:
+		value = cr0 & ~X86_CR0_TS;
+
+		break;
+
+	case CR_QUAL_ACCESS_LMSW:
+		/* loads PE, MP, EM and TS, but cannot clear PE */
+		value = (cr0 & ~0xEULL) |
+			((qualification >> CR_QUAL_LMSW_SHIFT) & 0xF);
+
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (peach_vcpu_set_cr0(vcpu, value)) {
+		peach_vcpu_inject_gp(vcpu);
+	} else {
+		skip_emulated_instruction(vcpu);
+	}
+
+	return 1;
+}
+
+/*
+ * Emulates a guest write of cr0, with the switch in and out of long mode
+ * and the PDPTE loads of PAE paging that come with PG, the way
+ * peach_vcpu_set_sregs() does. Returns -EINVAL for a value the CPU would
+ * refuse with #GP.
+ */
+static int peach_vcpu_set_cr0(struct peach_vcpu *vcpu, u64 cr0)
+{
+	int i;
+	int long_mode;
+
+	u64 old;
+	u64 cr3;
+	u64 cr4;
+	u64 efer;
+	u64 entry_controls;
+	u64 pdptrs[4];
+
+	old = (vmcs_read(GUEST_CR0) & ~X86_CR0_TS) |
+		(vmcs_read(CR0_READ_SHADOW) & X86_CR0_TS);
+	cr3 = vmcs_read(GUEST_CR3);
+	cr4 = vmcs_read(GUEST_CR4);
+
+	efer = 0;
+	if (vmcs_config.vmentry & VM_ENTRY_LOAD_IA32_EFER) {
+		efer = vmcs_read(GUEST_IA32_EFER);
+	}
+
+	long_mode = efer & EFER_LME && cr0 & X86_CR0_PG;
+
+	if (cr0 >> 32 || (cr0 & X86_CR0_PG && !(cr0 & X86_CR0_PE)) ||
+			(cr0 & X86_CR0_NW && !(cr0 & X86_CR0_CD)) ||
+			(long_mode && !(cr4 & X86_CR4_PAE))) {
+		return -EINVAL;
+	}
+
+	if ((cr0 ^ old) & X86_CR0_PG && cr0 & X86_CR0_PG &&
+			cr4 & X86_CR4_PAE && !long_mode) {
+		/* pinning may sleep, which needs preemption enabled again */
+		peach_vcpu_put(vcpu);
+		i = peach_read_pdptrs(vcpu->vm, cr3, pdptrs);
+		peach_vcpu_load(vcpu);
+
+		if (i) {
+			return i;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(pdptrs); i++) {
+			vmcs_write(GUEST_PDPTR0 + i * 2, pdptrs[i]);
+		}
+	}
+
+	if ((cr0 ^ old) & X86_CR0_PG && efer & EFER_LME) {
+		efer &= ~EFER_LMA;
+		entry_controls = vmcs_read(VM_ENTRY_CONTROLS) &
+			~VM_ENTRY_IA32E_MODE;
+		if (long_mode) {
+			efer |= EFER_LMA;
+			entry_controls |= VM_ENTRY_IA32E_MODE;
+		}
+
+		vmcs_write(GUEST_IA32_EFER, efer);
+		vmcs_write(VM_ENTRY_CONTROLS, entry_controls);
+	}
+
+	peach_vcpu_write_cr0(vcpu, cr0);
+
+	/* translations cached under the old paging mode carry our VPID */
+	if ((cr0 ^ old) & (X86_CR0_PG | X86_CR0_WP) && vcpu->vpid) {
+		invvpid(vmx_invvpid_type, vcpu->vpid);
+	}
+
+	return 0;
+}
+
+/*
+ * Gives the guest cr0. CR0.TS belongs to the host: the guest reads its
+ * own from the read shadow, and GUEST_CR0 has it set as well while the
+ * guest's FPU state is not active, see peach_vcpu_activate_fpu().
+ */
+static void peach_vcpu_write_cr0(struct peach_vcpu *vcpu, u64 cr0)
+{
+	vmcs_write(CR0_READ_SHADOW, cr0);
+
+	if (!vcpu->fpu_active) {
+		cr0 |= X86_CR0_TS;
+	}
+
+	vmcs_write(GUEST_CR0, cr0 | X86_CR0_NE);
+
+	return;
+}
+
+/* Makes the instruction at RIP fault with #GP(0) on the next entry. */
+static void peach_vcpu_inject_gp(struct peach_vcpu *vcpu)
+{
+	vmcs_write(VM_ENTRY_INTR_INFO_FIELD, GP_VECTOR |
+			INTR_TYPE_HARD_EXCEPTION | INTR_INFO_DELIVER_CODE_MASK |
+			INTR_INFO_VALID_MASK);
+	vmcs_write(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+
+	return;
+}
+
+/*
+ * Guest memory is populated on first touch, so a violation on a slot
+ * address that is not mapped yet is resolved here and the guest retries
+ * the access. A violation on an address whose current leaf grants the
+ * access was taken on a translation cached before the entry was
+ * upgraded; the exit itself invalidated it, so the guest just retries
+ * as well. Anything else is an access to memory the guest does not
+ * have, or a write to a read-only slot, and is emulated as MMIO.
+ */
+static int handle_ept_violation(struct peach_vcpu *vcpu,
+			struct peach_run *run)
+{
+	int ret;
+	int mode;
+	int level;
+	int len = 0;
+
+	u8 insn[15];
+
+	u64 gpa;
+	u64 rip;
+	u64 qualification;
+
+	u64 *entry;
+
+	struct peach_vm *vm;
+	struct peach_memslot *slot;
+	struct guest_paging paging;
+
+	vm = vcpu->vm;
+
+	gpa = vmcs_read(GUEST_PHYSICAL_ADDRESS);
+	qualification = vmcs_read(EXIT_QUALIFICATION);
+
+	/* the instruction is fetched from guest memory below */
+	mode = guest_code_size();
+	rip = vmcs_read(GUEST_RIP);
+	if (mode != 64) {
+		rip = (u32) (rip + vmcs_read(GUEST_CS_BASE));
+	}
+
+	guest_get_paging(&paging);
+
+	/* pinning may sleep, which needs preemption enabled again */
+	peach_vcpu_put(vcpu);
+
+	mutex_lock(&vm->mmu_lock);
+
+	entry = ept_lookup(vm, gpa, &level);
+	if (entry) {
+		ret = !(qualification & EPT_VIOLATION_ACC_MASK &
+				~(*entry & EPT_RWX));
+	} else if ((slot = peach_gfn_to_memslot(vm, gpa >> PAGE_SHIFT))) {
+		ret = peach_memslot_fault(vm, slot, gpa >> PAGE_SHIFT);
+		if (!ret) {
+			ret = 1;
+		}
+	} else {
+		ret = 0;
+	}
+
+	if (!ret) {
+		len = peach_read_guest_virt(vm, &paging, rip, insn, sizeof(insn));
+	}
+
+	mutex_unlock(&vm->mmu_lock);
+
+	peach_vcpu_load(vcpu);
+
+	if (!ret) {
+		ret = handle_mmio(vcpu, run, gpa, qualification, insn, len, mode);
+	}
+
+	return ret;
+}
+
+static void guest_get_paging(struct guest_paging *paging)
+{
+	int i;
+
+	u64 cr4;
+
+	memset(paging, 0, sizeof(*paging));
+
+	if (!(vmcs_read(GUEST_CR0) & X86_CR0_PG)) {
+		return;
+	}
+
+	cr4 = vmcs_read(GUEST_CR4);
+
+	paging->cr3 = vmcs_read(GUEST_CR3);
+	paging->pse = !!(cr4 & X86_CR4_PSE);
+
+	if (!(cr4 & X86_CR4_PAE)) {
+		paging->levels = 2;
+	} else if (vmcs_read(VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE) {
+		paging->levels = cr4 & X86_CR4_LA57 ? 5 : 4;
+	} else {
+		/* the CPU saved the PDPTEs it used on exit */
+		paging->levels = 3;
+		for (i = 0; i < ARRAY_SIZE(paging->pdptrs); i++) {
+			paging->pdptrs[i] = vmcs_read(GUEST_PDPTR0 + i * 2);
+		}
+	}
+
+	return;
+}
+
+/*
+ * Walks the guest's page tables for the linear address gva, without
+ * checking permissions or setting accessed bits. Returns 0 and sets *gpa,
+ * or -EFAULT if gva is not mapped. Called with vm->mmu_lock held.
+ */
+static int guest_translate(struct peach_vm *vm, struct guest_paging *paging,
+			u64 gva, u64 *gpa)
+{
+	int bits = 9;
+	int size = 8;
+	int level;
+	int shift;
+
+	u64 mask = GUEST_PT_ADDR_MASK;
+	u64 table;
+	u64 entry;
+	u64 offset;
+
+	if (!paging->levels) {
+		*gpa = gva;
+
+		return 0;
+	}
+
+	/* 32-bit paging has 4-byte entries and 10 bits per level */
+	if (paging->levels == 2) {
+		bits = 10;
+		size = 4;
+		mask = 0xFFFFF000ULL;
+	}
+
+	table = paging->cr3 & mask;
+	level = paging->levels;
+
+	if (level == 3) {
+		entry = paging->pdptrs[(gva >> 30) & 3];
+		if (!(entry & _PAGE_PRESENT)) {
+			return -EFAULT;
+		}
+
+		table = entry & mask;
+		level = 2;
+	}
+
+	for (; level > 0; level--) {
+		shift = PAGE_SHIFT + (level - 1) * bits;
+
+		entry = 0;
+		if (peach_read_guest(vm, table + ((gva >> shift) &
+						((1ULL << bits) - 1)) * size,
+					&entry, size) != size ||
+				!(entry & _PAGE_PRESENT)) {
+			return -EFAULT;
+		}
+
+		/* 4M pages need CR4.PSE, 2M and 1G ones are always there */
+		if (level == 1 || (entry & _PAGE_PSE && level <= 3 &&
+					(paging->levels != 2 || paging->pse))) {
+			offset = (1ULL << shift) - 1;
+			*gpa = (entry & mask & ~offset) | (gva & offset);
+
+			return 0;
+		}
+
+		table = entry & mask;
+	}
+
+	return -EFAULT;
+}
+
+/*
+ * Emulates the MOV in insn, len bytes of it fetched, that accessed gpa.
+ * Writes to a coalesced zone go to the ring and the guest carries on;
+ * other accesses go to userspace, and a read is finished on the next
+ * PEACH_RUN with the data userspace put in run->mmio. Anything that
+ * cannot be decoded goes to userspace as an unknown exit.
+ */
+static int handle_mmio(struct peach_vcpu *vcpu, struct peach_run *run,
+			u64 gpa, u64 qualification, const u8 *insn, int len,
+			int mode)
+{
+	u64 value;
+
+	struct mov_insn mov;
+
+	if (qualification & EPT_VIOLATION_ACC_INSTR ||
+			decode_mov(insn, len, mode, &mov) ||
+			mov.is_write != !!(qualification & EPT_VIOLATION_ACC_WRITE)) {
+		run->exit_reason = PEACH_EXIT_UNKNOWN;
+		run->hw.hardware_exit_reason = vcpu->exit_reason;
+		run->hw.exit_qualification = qualification;
+
+		return 0;
+	}
 
-		vmcs_field = 0x00006C00;
-		asm volatile (
-			"movq %%cr0, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host CR0 = 0x%llx\n", vmcs_field_value);
+	/* VM_EXIT_INSTRUCTION_LEN is not valid for EPT violations */
+	skip_instruction(vcpu, mov.len);
 
-		vmcs_field = 0x00006C02;
-		asm volatile (
-			"movq %%cr3, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host CR3 = 0x%llx\n", vmcs_field_value);
+	if (mov.is_write) {
+		value = mov.imm;
+		if (mov.reg >= 0) {
+			value = *guest_reg(vcpu, mov.reg) >> mov.shift;
+		}
 
-		vmcs_field = 0x00006C04;
-		asm volatile (
-			"movq %%cr4, %0\n\t"
-			: "=a" (vmcs_field_value)
-			:
-		);
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host CR4 = 0x%llx\n", vmcs_field_value);
+		if (peach_coalesced_append(vcpu->vm, gpa, mov.size, 0, value)) {
+			return 1;
+		}
+	} else {
+		value = 0;
 
-		vmcs_field = 0x00006C06;
-		ecx = 0xC0000100;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host FS base = 0x%llx\n", vmcs_field_value);
+		vcpu->pending_read = PEACH_EXIT_MMIO;
+		vcpu->pending_reg = mov.reg;
+		vcpu->pending_shift = mov.shift;
+		vcpu->pending_size = mov.size;
+	}
 
-		vmcs_field = 0x00006C08;
-		ecx = 0xC0000101;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host GS base = 0x%llx\n", vmcs_field_value);
+	run->exit_reason = PEACH_EXIT_MMIO;
+	run->mmio.phys_addr = gpa;
+	run->mmio.len = mov.size;
+	run->mmio.is_write = mov.is_write;
+	memset(run->mmio.data, 0, sizeof(run->mmio.data));
+	memcpy(run->mmio.data, &value, mov.size);
 
-		asm volatile (
-			"str %0\n\t"
-			: "=a" (host_tr_selector)
-			:
-		);
-		host_tr_selector &= 0xF8;
+	return 0;
+}
 
-		asm volatile (
-			"sgdt %0\n\t"
-			: "=m" (xdtr)
-			:
-		);
-		host_gdt_base = *((u64 *) (xdtr + 2));
+/*
+ * Decodes a MOV between memory and a register (88, 89, 8A, 8B) or an
+ * immediate (C6, C7) in code of mode bits. Only operand and address
+ * size, segment override and REX prefixes are accepted. Returns 0 and
+ * fills in *mov, or -EINVAL.
+ */
+static int decode_mov(const u8 *insn, int len, int mode,
+			struct mov_insn *mov)
+{
+	int i;
+	int mod;
+	int rm;
+	int opsize16 = 0;
+	int addr_size = mode;
+
+	u8 rex = 0;
+	u8 opcode;
+	u8 modrm;
+
+	for (i = 0; i < len; i++) {
+		if (insn[i] == 0x66) {
+			opsize16 = 1;
+		} else if (insn[i] == 0x67) {
+			addr_size = mode == 32 ? 16 : 32;
+		} else if (insn[i] != 0x26 && insn[i] != 0x2E &&
+				insn[i] != 0x36 && insn[i] != 0x3E &&
+				insn[i] != 0x64 && insn[i] != 0x65) {
+			break;
+		}
+	}
 
-		host_tr_desc = *((u64 *) (host_gdt_base + host_tr_selector));
-		vmcs_field_value = ((host_tr_desc & 0x000000FFFFFF0000) >> 16) | ((host_tr_desc & 0xFF00000000000000) >> 32);
+	/* REX only counts right before the opcode */
+	if (mode == 64 && i < len && (insn[i] & 0xF0) == 0x40) {
+		rex = insn[i++];
+	}
 
-		host_tr_desc = *((u64 *) (host_gdt_base + host_tr_selector + 8));
-		host_tr_desc <<= 32;
-		vmcs_field_value |= host_tr_desc;
+	if (i + 2 > len) {
+		return -EINVAL;
+	}
 
-		vmcs_field = 0x00006C0A;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host TR base = 0x%llx\n", vmcs_field_value);
+	opcode = insn[i++];
+	modrm = insn[i++];
 
-		vmcs_field = 0x00006C0C;
-		asm volatile (
-			"sgdt %0\n\t"
-			: "=m" (xdtr)
-			:
-		);
-		vmcs_field_value = *((u64 *) (xdtr + 2));
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host GDTR base = 0x%llx\n", vmcs_field_value);
+	mod = modrm >> 6;
+	rm = modrm & 7;
 
-		vmcs_field = 0x00006C0E;
-		asm volatile (
-			"sidt %0\n\t"
-			: "=m" (xdtr)
-			:
-		);
-		vmcs_field_value = *((u64 *) (xdtr + 2));
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IDTR base = 0x%llx\n", vmcs_field_value);
+	/* a register operand never accesses memory */
+	if (mod == 3) {
+		return -EINVAL;
+	}
 
-		vmcs_field = 0x00006C10;
-		ecx = 0x175;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_SYSENTER_ESP = 0x%llx\n", vmcs_field_value);
+	switch (opcode) {
+	case 0x88:
+	case 0x89:
+	case 0xC6:
+	case 0xC7:
+		mov->is_write = 1;
 
-		vmcs_field = 0x00006C12;
-		ecx = 0x176;
-		asm volatile (
-			"rdmsr\n\t"
-			: "=a" (eax), "=d" (edx)
-			: "c" (ecx)
-		);
-		rdx = edx;
-		vmcs_field_value = rdx << 32 | eax;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host IA32_SYSENTER_EIP = 0x%llx\n", vmcs_field_value);
+		break;
 
-		stack = (u8 *) kmalloc(0x8000, GFP_KERNEL);
-		vmcs_field = 0x00006C14;
-		vmcs_field_value = (u64) stack + 0x8000;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host RSP = 0x%llx\n", vmcs_field_value);
+	case 0x8A:
+	case 0x8B:
+		mov->is_write = 0;
 
-		vmcs_field = 0x00006C16;
-		vmcs_field_value = (u64) _vmexit_handler;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Host RIP = 0x%llx\n", vmcs_field_value);
+		break;
 
-		vmcs_field = 0x00000000;
-		vmcs_field_value = 0x0001;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("VPID = 0x%llx\n", vmcs_field_value);
+	default:
+		return -EINVAL;
+	}
 
-		vmcs_field = 0x0000201A;
-		vmcs_field_value = ept_pointer;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("EPT_POINTER = 0x%llx\n", vmcs_field_value);
+	if (!(opcode & 1)) {
+		mov->size = 1;
+	} else if (rex & 0x08) {
+		mov->size = 8;
+	} else if ((mode == 16) != opsize16) {
+		mov->size = 2;
+	} else {
+		mov->size = 4;
+	}
 
-		vmcs_field = 0x00004000;
-		vmcs_field_value = 0x00000016;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Pin-based VM-execution controls = 0x%llx\n", vmcs_field_value);
+	mov->shift = 0;
+	mov->reg = ((modrm >> 3) & 7) | (rex & 0x04) << 1;
 
-		vmcs_field = 0x00004002;
-		vmcs_field_value = 0x840061F2;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Primary Processor-based VM-execution controls = 0x%llx\n", vmcs_field_value);
+	if (opcode == 0xC6 || opcode == 0xC7) {
+		if (mov->reg) {
+			return -EINVAL;
+		}
 
-		vmcs_field = 0x0000401E;
-		vmcs_field_value = 0x000000A2;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("Secondary Processor-based VM-execution controls = 0x%llx\n", vmcs_field_value);
+		mov->reg = -1;
+	} else if (mov->size == 1 && !rex && mov->reg >= 4) {
+		/* AH, CH, DH and BH */
+		mov->reg -= 4;
+		mov->shift = 8;
+	} else if (mov->reg == 4) {
+		return -EINVAL;
+	}
 
-		vmcs_field = 0x00004012;
-		vmcs_field_value = 0x000011fb;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("VM-entry controls = 0x%llx\n", vmcs_field_value);
+	/* the displacement, and the SIB byte with its own */
+	if (addr_size == 16) {
+		if (mod == 1) {
+			i += 1;
+		} else if (mod == 2 || (mod == 0 && rm == 6)) {
+			i += 2;
+		}
+	} else {
+		if (rm == 4) {
+			if (i >= len) {
+				return -EINVAL;
+			}
 
-		vmcs_field = 0x0000400C;
-		vmcs_field_value = 0x00036ffb;
-		asm volatile (
-			"vmwrite %1, %0\n\t"
-			:
-			: "r" (vmcs_field), "r" (vmcs_field_value)
-		);
-		printk("VM-exit controls = 0x%llx\n", vmcs_field_value);
+			if (mod == 0 && (insn[i] & 7) == 5) {
+				i += 4;
+			}
 
-		asm volatile (
-			"movq %%rsp, %0\n\t"
-			"movq %%rbp, %1\n\t"
-			: "=a" (shutdown_rsp), "=b" (shutdown_rbp)
-			:
-		);
+			i++;
+		}
 
-		asm volatile (
-			"vmlaunch; setna %[ret]"
-			: [ret] "=rm" (ret1)
-			:
-			: "cc", "memory"
-		);
-		printk("vmlaunch = %d\n", ret1);
+		if (mod == 1) {
+			i += 1;
+		} else if (mod == 2 || (mod == 0 && rm == 5)) {
+			i += 4;
+		}
+	}
 
-		vmcs_field = 0x00004402;
-		asm volatile (
-			"vmread %1, %0\n\t"
-			: "=r" (vmcs_field_value)
-			: "r" (vmcs_field)
-		);
-		printk("EXIT_REASON = 0x%llx\n", vmcs_field_value);
+	mov->imm = 0;
+	if (mov->reg < 0) {
+		if (i + min(mov->size, 4) > len) {
+			return -EINVAL;
+		}
 
-		asm volatile ("shutdown:");
-		printk("********** guest shutdown **********\n");
+		memcpy(&mov->imm, insn + i, min(mov->size, 4));
 
-		asm volatile ("vmxoff");
+		/* a 32-bit immediate is sign-extended to a 64-bit operand */
+		if (mov->size == 8) {
+			mov->imm = (s64) (s32) mov->imm;
+		}
 
-		asm volatile (
-			"movq %cr4, %rax\n\t"
-			"btr $13, %rax\n\t"
-			"movq %rax, %cr4"
-		);
+		i += min(mov->size, 4);
+	}
 
-		break;
+	if (i > len) {
+		return -EINVAL;
 	}
 
+	mov->len = i;
+
 	return 0;
 }
 
-void handle_vmexit(struct guest_regs *regs)
+static inline int ept_index(u64 gpa, int level)
 {
-	u64 vmcs_field;
-	u64 vmcs_field_value;
-	u64 guest_rip;
+	return (gpa >> (PAGE_SHIFT + 9 * (level - 1))) & (EPT_ENTRIES - 1);
+}
 
-	dump_guest_regs(regs);
+/* the amount of guest-physical memory one entry at level maps */
+static inline u64 ept_level_size(int level)
+{
+	return 1ULL << (PAGE_SHIFT + 9 * (level - 1));
+}
 
-	vmcs_field = 0x00004402;
-	asm volatile (
-		"vmread %1, %0\n\t"
-		: "=r" (vmcs_field_value)
-		: "r" (vmcs_field)
-	);
-	printk("EXIT_REASON = 0x%llx\n", vmcs_field_value);
+static inline int ept_is_leaf(u64 entry, int level)
+{
+	return level == 1 || (entry & EPT_LARGE);
+}
 
-	switch (vmcs_field_value) {
-	case 0x0C:
-		asm volatile (
-			"movq %0, %%rsp\n\t"
-			"movq %1, %%rbp\n\t"
-			"jmp shutdown\n\t"
-			:
-			: "a" (shutdown_rsp), "b" (shutdown_rbp)
-		);
+static inline u64 *ept_table(u64 entry)
+{
+	return (u64 *) __va(entry & EPT_ADDR_MASK);
+}
 
-		break;
+/* the highest level that may hold a leaf: 3 for 1G, 2 for 2M pages */
+static int ept_max_leaf_level(void)
+{
+	if (vmx_ept_vpid_cap & VMX_EPT_1GB_PAGE_BIT) {
+		return 3;
+	}
 
-	case 0x0A:
-		regs->rax = 0x6368;
-		regs->rbx = 0x6561;
-		regs->rcx = 0x70;
+	if (vmx_ept_vpid_cap & VMX_EPT_2MB_PAGE_BIT) {
+		return 2;
+	}
 
-		break;
+	return 1;
+}
 
-	default:
-		break;
+/*
+ * Replaces the large leaf *entry at level with a table of leaves one
+ * level down that map the same memory with the same attributes.
+ */
+static int ept_split(u64 *entry, int level)
+{
+	int i;
+
+	u64 pa;
+	u64 attr;
+
+	u64 *table;
+
+	pa = *entry & EPT_ADDR_MASK;
+
+	table = ept_alloc_table(pa);
+	if (!table) {
+		return -ENOMEM;
 	}
 
-	vmcs_field = 0x0000681E;
-	asm volatile (
-		"vmread %1, %0\n\t"
-		: "=r" (vmcs_field_value)
-		: "r" (vmcs_field)
-	);
-	printk("Guest RIP = 0x%llx\n", vmcs_field_value);
+	attr = *entry & ~EPT_ADDR_MASK;
+	if (level - 1 == 1) {
+		attr &= ~EPT_LARGE;
+	}
 
-	guest_rip = vmcs_field_value;
+	for (i = 0; i < EPT_ENTRIES; i++) {
+		table[i] = (pa + i * ept_level_size(level - 1)) | attr;
+	}
 
-	vmcs_field = 0x0000440C;
-	asm volatile (
-		"vmread %1, %0\n\t"
-		: "=r" (vmcs_field_value)
-		: "r" (vmcs_field)
-	);
-	printk("VM-exit instruction length = 0x%llx\n", vmcs_field_value);
+	init_ept_table_entry(entry, __pa(table));
 
-	vmcs_field = 0x0000681E;
-	vmcs_field_value = guest_rip + vmcs_field_value;
-	asm volatile (
-		"vmwrite %1, %0\n\t"
-		:
-		: "r" (vmcs_field), "r" (vmcs_field_value)
-	);
-	printk("Guest RIP = 0x%llx\n", vmcs_field_value);
+	return 0;
+}
+
+/*
+ * Walks down to the entry that maps gpa at level, allocating paging
+ * structures for the memory at hpa and splitting larger leaves on the way.
+ */
+static u64 *ept_walk(struct peach_vm *vm, u64 gpa, u64 hpa, int level,
+			int *flush)
+{
+	int l;
+
+	u64 *table;
+	u64 *entry;
+	u64 *next;
+
+	table = vm->ept_root;
+
+	for (l = EPT_LEVELS; l > level; l--) {
+		entry = &table[ept_index(gpa, l)];
+
+		if (!(*entry & EPT_RWX)) {
+			next = ept_alloc_table(hpa);
+			if (!next) {
+				return NULL;
+			}
+
+			init_ept_table_entry(entry, __pa(next));
+		} else if (*entry & EPT_LARGE) {
+			if (ept_split(entry, l)) {
+				return NULL;
+			}
+
+			*flush = 1;
+		}
+
+		table = ept_table(*entry);
+	}
+
+	return &table[ept_index(gpa, level)];
+}
+
+/* Returns the leaf that maps gpa and its level, or NULL. */
+static u64 *ept_lookup(struct peach_vm *vm, u64 gpa, int *level)
+{
+	int l;
+
+	u64 *table;
+	u64 *entry;
+
+	table = vm->ept_root;
+
+	for (l = EPT_LEVELS; l >= 1; l--) {
+		entry = &table[ept_index(gpa, l)];
+
+		if (!(*entry & EPT_RWX)) {
+			return NULL;
+		}
+
+		if (ept_is_leaf(*entry, l)) {
+			*level = l;
+
+			return entry;
+		}
+
+		table = ept_table(*entry);
+	}
+
+	return NULL;
+}
+
+/*
+ * Maps the physically contiguous range [hpa, hpa + size) at gpa with
+ * prot, a combination of EPT_READ, EPT_WRITE and EPT_EXEC, using the
+ * largest leaves that alignment, size and the CPU allow.
+ *
+ * Filling in entries that were not present never needs a flush, since
+ * not-present translations are not cached. *flush is set when an entry
+ * the guest could already use was split, replaced or lost a permission;
+ * gaining one does not count because the EPT violation on a stale
+ * translation invalidates it and the guest simply retries.
+ */
+static int ept_map_range(struct peach_vm *vm, u64 gpa, u64 hpa, u64 size,
+			u64 prot, int *flush)
+{
+	int level;
+
+	u64 leaf_size;
+
+	u64 *entry;
+
+	while (size) {
+		for (level = ept_max_leaf_level(); level > 1; level--) {
+			leaf_size = ept_level_size(level);
+
+			if (IS_ALIGNED(gpa | hpa, leaf_size) &&
+					size >= leaf_size) {
+				break;
+			}
+		}
+
+		leaf_size = ept_level_size(level);
+
+		entry = ept_walk(vm, gpa, hpa, level, flush);
+		if (!entry) {
+			return -ENOMEM;
+		}
+
+		if (*entry & EPT_RWX) {
+			if (!ept_is_leaf(*entry, level)) {
+				ept_defer_free_table(vm, ept_table(*entry),
+						level - 1);
+				*flush = 1;
+			} else if ((*entry & EPT_ADDR_MASK) != hpa ||
+					(*entry & EPT_RWX & ~prot)) {
+				*flush = 1;
+			}
+		}
+
+		init_ept_leaf(entry, hpa, prot, level);
+
+		gpa += leaf_size;
+		hpa += leaf_size;
+		size -= leaf_size;
+	}
+
+	return 0;
+}
+
+/*
+ * Removes every present leaf in [start, end) below table. Leaves that the
+ * range only partly covers are split first, subtrees it fully covers are
+ * freed once the flush *flush asks for is done.
+ */
+static int ept_clear_range(struct peach_vm *vm, u64 *table, int level,
+			u64 start, u64 end, int *flush)
+{
+	int ret;
+
+	u64 size;
+	u64 addr;
+	u64 next;
+
+	u64 *entry;
+
+	size = ept_level_size(level);
+
+	for (addr = start; addr < end; addr = next) {
+		next = min(ALIGN_DOWN(addr, size) + size, end);
+		entry = &table[ept_index(addr, level)];
+
+		if (!(*entry & EPT_RWX)) {
+			continue;
+		}
+
+		if (IS_ALIGNED(addr, size) && next - addr == size) {
+			if (!ept_is_leaf(*entry, level)) {
+				ept_defer_free_table(vm, ept_table(*entry),
+						level - 1);
+			}
+
+			*entry = 0;
+			*flush = 1;
+
+			continue;
+		}
+
+		if (ept_is_leaf(*entry, level)) {
+			ret = ept_split(entry, level);
+			if (ret) {
+				return ret;
+			}
+
+			*flush = 1;
+		}
+
+		ret = ept_clear_range(vm, ept_table(*entry), level - 1,
+				addr, next, flush);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Moves the dirty flags of the leaves in [start, end) into bitmap, whose
+ * bit 0 stands for the page at base. The processor sets the flags
+ * concurrently, so they are cleared atomically.
+ */
+static void ept_harvest_dirty(u64 *table, int level, u64 start, u64 end,
+			u64 base, unsigned long *bitmap, int *flush)
+{
+	u64 size;
+	u64 addr;
+	u64 next;
+
+	u64 *entry;
+
+	size = ept_level_size(level);
+
+	for (addr = start; addr < end; addr = next) {
+		next = min(ALIGN_DOWN(addr, size) + size, end);
+		entry = &table[ept_index(addr, level)];
+
+		if (!(*entry & EPT_RWX)) {
+			continue;
+		}
+
+		if (!ept_is_leaf(*entry, level)) {
+			ept_harvest_dirty(ept_table(*entry), level - 1,
+					addr, next, base, bitmap, flush);
+
+			continue;
+		}
+
+		if (test_and_clear_bit(EPT_DIRTY_SHIFT,
+					(unsigned long *) entry)) {
+			bitmap_set(bitmap, (addr - base) >> PAGE_SHIFT,
+					(next - addr) >> PAGE_SHIFT);
+			*flush = 1;
+		}
+	}
 
 	return;
 }
 
-static void init_ept(u64 *ept_pointer, u64 guest_memory_pa)
+/*
+ * Clears the dirty flags of the slot's pages that are set in its bitmap,
+ * so the next write to them is logged again.
+ */
+static void ept_clean_dirty(struct peach_vm *vm, struct peach_memslot *slot,
+			int *flush)
 {
-	int i;
+	int level;
 
-	u64 ept_va;
-	u64 ept_pa;
+	unsigned long i;
 
 	u64 *entry;
 
-	ept_memory = (u8 *) kmalloc(EPT_MEMORY_SIZE, GFP_KERNEL);
-	memset(ept_memory, 0, EPT_MEMORY_SIZE);
+	for_each_set_bit(i, slot->dirty_bitmap, slot->npages) {
+		entry = ept_lookup(vm, (slot->base_gfn + i) << PAGE_SHIFT,
+				&level);
+		if (entry && test_and_clear_bit(EPT_DIRTY_SHIFT,
+					(unsigned long *) entry)) {
+			*flush = 1;
+		}
+	}
+
+	return;
+}
 
-	ept_va = (u64) ept_memory;
-	ept_pa = __pa(ept_memory);
+static int ept_unmap_range(struct peach_vm *vm, u64 gpa, u64 size,
+			int *flush)
+{
+	return ept_clear_range(vm, vm->ept_root, EPT_LEVELS, gpa, gpa + size,
+			flush);
+}
 
-	init_ept_pointer(ept_pointer, ept_pa);
+/*
+ * Allocates a paging structure on the node of the memory at pa. The
+ * vCPUs that walk down to it are placed near the memory they use, so the
+ * walk stays as local as the access it translates.
+ */
+static u64 *ept_alloc_table(u64 pa)
+{
+	struct page *page;
 
-	entry = (u64 *) ept_va;
-	init_pml4e(entry, ept_pa + 0x1000);
-	printk("pml4e = 0x%llx\n", *entry);
+	page = alloc_pages_node(page_to_nid(pfn_to_page(pa >> PAGE_SHIFT)),
+			GFP_KERNEL_ACCOUNT | __GFP_ZERO, 0);
+	if (!page) {
+		return NULL;
+	}
 
-	entry = (u64 *) (ept_va + 0x1000);
-	init_pdpte(entry, ept_pa + 0x2000);
-	printk("pdpte = 0x%llx\n", *entry);
+	return (u64 *) page_address(page);
+}
 
-	entry = (u64 *) (ept_va + 0x2000);
-	init_pde(entry, ept_pa + 0x3000);
-	printk("pdte = 0x%llx\n", *entry);
+static void ept_free_table(u64 *table, int level)
+{
+	int i;
 
-	for (i = 0; i < 16; i++) {
-		entry = (u64 *) (ept_va + 0x3000 + i * 8);
-		init_pte(entry, guest_memory_pa + i * 0x1000);
-		printk("pte = 0x%llx\n", *entry);
+	if (level > 1) {
+		for (i = 0; i < EPT_ENTRIES; i++) {
+			if ((table[i] & EPT_RWX) &&
+					!ept_is_leaf(table[i], level)) {
+				ept_free_table(ept_table(table[i]), level - 1);
+			}
+		}
 	}
 
+	free_page((unsigned long) table);
+
 	return;
 }
 
-static void init_ept_pointer(u64 *p, u64 pa)
+/*
+ * ept_free_table() for a subtree that was just unlinked: its tables wait
+ * on vm->ept_freed until the flush that makes them unreachable.
+ */
+static void ept_defer_free_table(struct peach_vm *vm, u64 *table, int level)
 {
-	*p = pa | 1 << 6 | 3 << 3 | 6;
+	int i;
+
+	if (level > 1) {
+		for (i = 0; i < EPT_ENTRIES; i++) {
+			if ((table[i] & EPT_RWX) &&
+					!ept_is_leaf(table[i], level)) {
+				ept_defer_free_table(vm, ept_table(table[i]),
+						level - 1);
+			}
+		}
+	}
+
+	list_add(&virt_to_page(table)->lru, &vm->ept_freed);
 
 	return;
 }
 
-static void init_pml4e(u64 *entry, u64 pa)
+static void ept_free_deferred(struct peach_vm *vm)
 {
-	*entry = pa | 1 << 2 | 1 << 1 | 1;
+	struct page *page;
+	struct page *next;
+
+	list_for_each_entry_safe(page, next, &vm->ept_freed, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
 
 	return;
 }
 
-static void init_pdpte(u64 *entry, u64 pa)
+static void init_ept_pointer(u64 *p, u64 pa)
 {
-	*entry = pa | 1 << 2 | 1 << 1 | 1;
+	/* 4-level walk, write-back paging structures */
+	*p = pa | 3 << 3 | 6;
+
+	/* the processor only maintains accessed and dirty flags on request */
+	if (vmx_ept_vpid_cap & VMX_EPT_AD_BIT) {
+		*p |= 1 << 6;
+	}
 
 	return;
 }
 
-static void init_pde(u64 *entry, u64 pa)
+static void init_ept_table_entry(u64 *entry, u64 pa)
 {
-	*entry = pa | 1 << 2 | 1 << 1 | 1;
+	*entry = pa | EPT_RWX;
 
 	return;
 }
 
-static void init_pte(u64 *entry, u64 pa)
+static void init_ept_leaf(u64 *entry, u64 pa, u64 prot, int level)
 {
-	*entry = pa | 6 << 3 | 1 << 2 | 1 << 1 | 1;
+	*entry = pa | EPT_MT_WB | prot;
+
+	if (level > 1) {
+		*entry |= EPT_LARGE;
+	}
 
 	return;
 }
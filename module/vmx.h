@@ -0,0 +1,359 @@
+#ifndef __VMX_H__
+#define __VMX_H__
+
+#include <linux/types.h>
+
+#define MSR_IA32_SYSENTER_CS 0x00000174
+#define MSR_IA32_SYSENTER_ESP 0x00000175
+#define MSR_IA32_SYSENTER_EIP 0x00000176
+
+#define MSR_IA32_VMX_BASIC 0x00000480
+#define MSR_IA32_VMX_PINBASED_CTLS 0x00000481
+#define MSR_IA32_VMX_PROCBASED_CTLS 0x00000482
+#define MSR_IA32_VMX_EXIT_CTLS 0x00000483
+#define MSR_IA32_VMX_ENTRY_CTLS 0x00000484
+#define MSR_IA32_VMX_MISC 0x00000485
+
+/* IA32_VMX_BASIC bits */
+#define VMX_BASIC_REVISION_ID_MASK 0x7FFFFFFFULL
+#define VMX_BASIC_TRUE_CTLS (1ULL << 55)
+
+/* pin-based VM-execution controls */
+#define PIN_BASED_EXT_INTR_MASK (1U << 0)
+#define PIN_BASED_NMI_EXITING (1U << 3)
+#define PIN_BASED_VMX_PREEMPTION_TIMER (1U << 6)
+
+/* primary processor-based VM-execution controls */
+#define CPU_BASED_INTR_WINDOW_EXITING (1U << 2)
+#define CPU_BASED_HLT_EXITING (1U << 7)
+#define CPU_BASED_UNCOND_IO_EXITING (1U << 24)
+#define CPU_BASED_USE_IO_BITMAPS (1U << 25)
+#define CPU_BASED_USE_MSR_BITMAPS (1U << 28)
+#define CPU_BASED_ACTIVATE_SECONDARY_CONTROLS (1U << 31)
+
+/* secondary processor-based VM-execution controls */
+#define SECONDARY_EXEC_ENABLE_EPT (1U << 1)
+#define SECONDARY_EXEC_ENABLE_VPID (1U << 5)
+#define SECONDARY_EXEC_UNRESTRICTED_GUEST (1U << 7)
+#define SECONDARY_EXEC_ENABLE_PML (1U << 17)
+
+/* VM-exit controls */
+#define VM_EXIT_HOST_ADDR_SPACE_SIZE (1U << 9)
+#define VM_EXIT_SAVE_IA32_EFER (1U << 20)
+#define VM_EXIT_LOAD_IA32_EFER (1U << 21)
+
+/* VM-entry controls */
+#define VM_ENTRY_IA32E_MODE (1U << 9)
+#define VM_ENTRY_LOAD_IA32_EFER (1U << 15)
+
+/* the preemption timer counts down once every 2^rate TSC cycles */
+#define VMX_MISC_PREEMPTION_TIMER_RATE_MASK 0x1FULL
+
+/* IA32_VMX_EPT_VPID_CAP bits */
+#define VMX_EPT_PAGE_WALK_4_BIT (1ULL << 6)
+#define VMX_EPTP_WB_BIT (1ULL << 14)
+#define VMX_EPT_2MB_PAGE_BIT (1ULL << 16)
+#define VMX_EPT_1GB_PAGE_BIT (1ULL << 17)
+#define VMX_EPT_AD_BIT (1ULL << 21)
+#define VMX_EPT_EXTENT_CONTEXT_BIT (1ULL << 25)
+#define VMX_EPT_EXTENT_GLOBAL_BIT (1ULL << 26)
+#define VMX_VPID_INVVPID_BIT (1ULL << 32)
+#define VMX_VPID_EXTENT_SINGLE_CONTEXT_BIT (1ULL << 41)
+#define VMX_VPID_EXTENT_ALL_CONTEXT_BIT (1ULL << 42)
+
+/* VMCS field encodings */
+#define VIRTUAL_PROCESSOR_ID 0x00000000
+#define GUEST_ES_SELECTOR 0x00000800
+#define GUEST_CS_SELECTOR 0x00000802
+#define GUEST_SS_SELECTOR 0x00000804
+#define GUEST_DS_SELECTOR 0x00000806
+#define GUEST_FS_SELECTOR 0x00000808
+#define GUEST_GS_SELECTOR 0x0000080A
+#define GUEST_LDTR_SELECTOR 0x0000080C
+#define GUEST_TR_SELECTOR 0x0000080E
+#define GUEST_PML_INDEX 0x00000812
+#define HOST_ES_SELECTOR 0x00000C00
+#define HOST_CS_SELECTOR 0x00000C02
+#define HOST_SS_SELECTOR 0x00000C04
+#define HOST_DS_SELECTOR 0x00000C06
+#define HOST_FS_SELECTOR 0x00000C08
+#define HOST_GS_SELECTOR 0x00000C0A
+#define HOST_TR_SELECTOR 0x00000C0C
+#define IO_BITMAP_A 0x00002000
+#define IO_BITMAP_B 0x00002002
+#define MSR_BITMAP 0x00002004
+#define PML_ADDRESS 0x0000200E
+#define EPT_POINTER 0x0000201A
+#define GUEST_PHYSICAL_ADDRESS 0x00002400
+#define VMCS_LINK_POINTER 0x00002800
+#define GUEST_IA32_EFER 0x00002806
+#define GUEST_PDPTR0 0x0000280A
+#define GUEST_PDPTR1 0x0000280C
+#define GUEST_PDPTR2 0x0000280E
+#define GUEST_PDPTR3 0x00002810
+#define HOST_IA32_EFER 0x00002C02
+#define PIN_BASED_VM_EXEC_CONTROL 0x00004000
+#define CPU_BASED_VM_EXEC_CONTROL 0x00004002
+#define EXCEPTION_BITMAP 0x00004004
+#define VM_EXIT_CONTROLS 0x0000400C
+#define VM_ENTRY_CONTROLS 0x00004012
+#define VM_ENTRY_INTR_INFO_FIELD 0x00004016
+#define VM_ENTRY_EXCEPTION_ERROR_CODE 0x00004018
+#define VM_ENTRY_INSTRUCTION_LEN 0x0000401A
+#define SECONDARY_VM_EXEC_CONTROL 0x0000401E
+#define VM_INSTRUCTION_ERROR 0x00004400
+#define VM_EXIT_REASON 0x00004402
+#define VM_EXIT_INTR_INFO 0x00004404
+#define IDT_VECTORING_INFO_FIELD 0x00004408
+#define IDT_VECTORING_ERROR_CODE 0x0000440A
+#define VM_EXIT_INSTRUCTION_LEN 0x0000440C
+#define GUEST_ES_LIMIT 0x00004800
+#define GUEST_CS_LIMIT 0x00004802
+#define GUEST_SS_LIMIT 0x00004804
+#define GUEST_DS_LIMIT 0x00004806
+#define GUEST_FS_LIMIT 0x00004808
+#define GUEST_GS_LIMIT 0x0000480A
+#define GUEST_LDTR_LIMIT 0x0000480C
+#define GUEST_TR_LIMIT 0x0000480E
+#define GUEST_GDTR_LIMIT 0x00004810
+#define GUEST_IDTR_LIMIT 0x00004812
+#define GUEST_ES_AR_BYTES 0x00004814
+#define GUEST_CS_AR_BYTES 0x00004816
+#define GUEST_SS_AR_BYTES 0x00004818
+#define GUEST_DS_AR_BYTES 0x0000481A
+#define GUEST_FS_AR_BYTES 0x0000481C
+#define GUEST_GS_AR_BYTES 0x0000481E
+#define GUEST_LDTR_AR_BYTES 0x00004820
+#define GUEST_TR_AR_BYTES 0x00004822
+#define GUEST_INTERRUPTIBILITY_INFO 0x00004824
+#define VMX_PREEMPTION_TIMER_VALUE 0x0000482E
+#define HOST_IA32_SYSENTER_CS 0x00004C00
+#define CR0_GUEST_HOST_MASK 0x00006000
+#define CR4_GUEST_HOST_MASK 0x00006002
+#define CR0_READ_SHADOW 0x00006004
+#define CR4_READ_SHADOW 0x00006006
+#define EXIT_QUALIFICATION 0x00006400
+#define GUEST_CR0 0x00006800
+#define GUEST_CR3 0x00006802
+#define GUEST_CR4 0x00006804
+#define GUEST_ES_BASE 0x00006806
+#define GUEST_CS_BASE 0x00006808
+#define GUEST_SS_BASE 0x0000680A
+#define GUEST_DS_BASE 0x0000680C
+#define GUEST_FS_BASE 0x0000680E
+#define GUEST_GS_BASE 0x00006810
+#define GUEST_LDTR_BASE 0x00006812
+#define GUEST_TR_BASE 0x00006814
+#define GUEST_GDTR_BASE 0x00006816
+#define GUEST_IDTR_BASE 0x00006818
+#define GUEST_RSP 0x0000681C
+#define GUEST_RIP 0x0000681E
+#define GUEST_RFLAGS 0x00006820
+#define HOST_CR0 0x00006C00
+#define HOST_CR3 0x00006C02
+#define HOST_CR4 0x00006C04
+#define HOST_FS_BASE 0x00006C06
+#define HOST_GS_BASE 0x00006C08
+#define HOST_TR_BASE 0x00006C0A
+#define HOST_GDTR_BASE 0x00006C0C
+#define HOST_IDTR_BASE 0x00006C0E
+#define HOST_IA32_SYSENTER_ESP 0x00006C10
+#define HOST_IA32_SYSENTER_EIP 0x00006C12
+#define HOST_RSP 0x00006C14
+#define HOST_RIP 0x00006C16
+
+/* basic exit reasons, bits 15:0 of VM_EXIT_REASON */
+#define EXIT_REASON_EXCEPTION_NMI 0
+#define EXIT_REASON_EXTERNAL_INTERRUPT 1
+#define EXIT_REASON_TRIPLE_FAULT 2
+#define EXIT_REASON_INTERRUPT_WINDOW 7
+#define EXIT_REASON_CPUID 10
+#define EXIT_REASON_HLT 12
+#define EXIT_REASON_VMCALL 18
+#define EXIT_REASON_CR_ACCESS 28
+#define EXIT_REASON_IO_INSTRUCTION 30
+#define EXIT_REASON_MSR_READ 31
+#define EXIT_REASON_MSR_WRITE 32
+#define EXIT_REASON_EPT_VIOLATION 48
+#define EXIT_REASON_PREEMPTION_TIMER 52
+#define EXIT_REASON_PML_FULL 62
+
+#define VMX_EXIT_REASONS_BASIC_MASK 0x0000FFFF
+#define VMX_EXIT_REASONS_FAILED_VMENTRY 0x80000000
+
+/* EPT paging-structure entries */
+#define EPT_READ (1ULL << 0)
+#define EPT_WRITE (1ULL << 1)
+#define EPT_EXEC (1ULL << 2)
+#define EPT_RWX (EPT_READ | EPT_WRITE | EPT_EXEC)
+#define EPT_MT_WB (6ULL << 3)
+#define EPT_LARGE (1ULL << 7)
+#define EPT_ACCESSED (1ULL << 8)
+#define EPT_DIRTY_SHIFT 9
+#define EPT_DIRTY (1ULL << EPT_DIRTY_SHIFT)
+#define EPT_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/* the access bits of an EPT violation's exit qualification line up with EPT_RWX */
+#define EPT_VIOLATION_ACC_MASK 0x7ULL
+#define EPT_VIOLATION_ACC_WRITE (1ULL << 1)
+#define EPT_VIOLATION_ACC_INSTR (1ULL << 2)
+
+/*
+ * The MSR bitmap holds one bit per MSR for 0-0x1FFF and for
+ * 0xC0000000-0xC0001FFF, reads in its first half and writes in its
+ * second. A set bit makes the access exit.
+ */
+#define MSR_BITMAP_LOW_END 0x00002000
+#define MSR_BITMAP_HIGH_BASE 0xC0000000
+#define MSR_BITMAP_HIGH_OFFSET (1024 * 8)
+#define MSR_BITMAP_WRITE_OFFSET (2048 * 8)
+
+/* VM-entry interruption information and IDT-vectoring information */
+#define INTR_INFO_VECTOR_MASK 0xFFU
+#define INTR_INFO_INTR_TYPE_MASK (7U << 8)
+#define INTR_TYPE_EXT_INTR (0U << 8)
+#define INTR_TYPE_NMI_INTR (2U << 8)
+#define INTR_TYPE_HARD_EXCEPTION (3U << 8)
+#define INTR_INFO_DELIVER_CODE_MASK (1U << 11)
+#define INTR_INFO_UNBLOCK_NMI (1U << 12)
+#define INTR_INFO_VALID_MASK (1U << 31)
+
+#define NM_VECTOR 7
+#define GP_VECTOR 13
+
+/* guest interruptibility state */
+#define GUEST_INTR_STATE_STI (1U << 0)
+#define GUEST_INTR_STATE_MOV_SS (1U << 1)
+
+/* exit qualification of a control-register access */
+#define CR_QUAL_CR_MASK 0xFULL
+#define CR_QUAL_ACCESS_MASK (3ULL << 4)
+#define CR_QUAL_ACCESS_MOV_TO_CR (0ULL << 4)
+#define CR_QUAL_ACCESS_CLTS (2ULL << 4)
+#define CR_QUAL_ACCESS_LMSW (3ULL << 4)
+#define CR_QUAL_REG_MASK 0xFULL
+#define CR_QUAL_REG_SHIFT 8
+#define CR_QUAL_LMSW_SHIFT 16
+
+/* exit qualification of an I/O instruction */
+#define IO_QUAL_SIZE_MASK 0x7ULL
+#define IO_QUAL_IN (1ULL << 3)
+#define IO_QUAL_STRING (1ULL << 4)
+#define IO_QUAL_PORT_SHIFT 16
+
+/* access rights of a segment, as in the GUEST_*_AR_BYTES fields */
+#define VMX_AR_TYPE_MASK 0xFU
+#define VMX_AR_S (1U << 4)
+#define VMX_AR_DPL_SHIFT 5
+#define VMX_AR_DPL_MASK (3U << VMX_AR_DPL_SHIFT)
+#define VMX_AR_P (1U << 7)
+#define VMX_AR_AVL (1U << 12)
+#define VMX_AR_L (1U << 13)
+#define VMX_AR_DB (1U << 14)
+#define VMX_AR_G (1U << 15)
+#define VMX_AR_UNUSABLE (1U << 16)
+
+/* the page-modification log is one page of guest-physical addresses */
+#define PML_ENTITY_NUM 512
+
+#define EPT_LEVELS 4
+#define EPT_ENTRIES 512
+
+/* INVEPT types */
+#define VMX_EPT_EXTENT_CONTEXT 1
+#define VMX_EPT_EXTENT_GLOBAL 2
+
+/* INVVPID types */
+#define VMX_VPID_EXTENT_SINGLE_CONTEXT 1
+#define VMX_VPID_EXTENT_ALL_CONTEXT 2
+
+static inline u64 vmcs_read(u64 field)
+{
+	u64 value;
+
+	asm volatile (
+		"vmread %1, %0\n\t"
+		: "=r" (value)
+		: "r" (field)
+		: "cc"
+	);
+
+	return value;
+}
+
+static inline void vmcs_write(u64 field, u64 value)
+{
+	asm volatile (
+		"vmwrite %1, %0\n\t"
+		:
+		: "r" (field), "r" (value)
+		: "cc"
+	);
+
+	return;
+}
+
+/* Returns nonzero if the instruction failed. */
+static inline u8 vmcs_clear(u64 pa)
+{
+	u8 error;
+
+	asm volatile (
+		"vmclear %[pa]; setna %[error]"
+		: [error] "=rm" (error)
+		: [pa] "m" (pa)
+		: "cc", "memory"
+	);
+
+	return error;
+}
+
+static inline u8 vmcs_load(u64 pa)
+{
+	u8 error;
+
+	asm volatile (
+		"vmptrld %[pa]; setna %[error]"
+		: [error] "=rm" (error)
+		: [pa] "m" (pa)
+		: "cc", "memory"
+	);
+
+	return error;
+}
+
+static inline void invvpid(u64 type, u16 vpid)
+{
+	struct {
+		u64 vpid;
+		u64 gva;
+	} operand = { vpid, 0 };
+
+	asm volatile (
+		"invvpid %0, %1\n\t"
+		:
+		: "m" (operand), "r" (type)
+		: "cc", "memory"
+	);
+
+	return;
+}
+
+static inline void invept(u64 type, u64 eptp)
+{
+	struct {
+		u64 eptp;
+		u64 reserved;
+	} operand = { eptp, 0 };
+
+	asm volatile (
+		"invept %0, %1\n\t"
+		:
+		: "m" (operand), "r" (type)
+		: "cc", "memory"
+	);
+
+	return;
+}
+
+#endif